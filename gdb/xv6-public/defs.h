@@ -1,7 +1,9 @@
 struct buf;
 struct context;
+struct fdtable;
 struct file;
 struct inode;
+struct kmem_cache;
 struct pipe;
 struct proc;
 struct rtcdate;
@@ -33,6 +35,10 @@ void            fileinit(void);
 int             fileread(struct file*, char*, int n);
 int             filestat(struct file*, struct stat*);
 int             filewrite(struct file*, char*, int n);
+struct fdtable* fdtalloc(struct inode*);
+struct fdtable* fdtcopy(struct fdtable*);
+struct fdtable* fdtdup(struct fdtable*);
+void            fdtclose(struct fdtable*);
 
 // milestone 2
 int		filepread(struct file*, char*, int n, int off);
@@ -44,6 +50,7 @@ int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            icacheinit(void);
 void            iinit(int dev);
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -69,6 +76,13 @@ void            ioapicinit(void);
 
 // kalloc.c
 char*           kalloc(void);
+char*           kalloc_zeroed(void);
+void            kref(char*);
+int             kshared(char*);
+char*           kalloc_order(int);
+void            kfree_order(char*, int);
+void            kmemdump(void);
+int             kzerofill(void);
 void            kfree(char*);
 void            kinit1(void*, void*);
 void            kinit2(void*, void*);
@@ -82,6 +96,9 @@ int             lapicid(void);
 extern volatile uint*    lapic;
 void            lapiceoi(void);
 void            lapicinit(void);
+void            lapicquantum(int);
+void            lapicipi(int, int);
+extern uint64   tickns;
 void            lapicstartap(uchar, uint);
 void            microdelay(int);
 
@@ -104,6 +121,7 @@ void            picinit(void);
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
+void            pipeinit(void);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, char*, int);
 
@@ -111,7 +129,6 @@ int             pipewrite(struct pipe*, char*, int);
 // proc.c
 extern volatile int num_stride; // 0 if no stride process, 1 if stride process
 extern volatile int total_share; // to make exception possible
-extern volatile int multithreading;
 int             cpuid(void);
 void            exit(void);
 int             fork(void);
@@ -130,15 +147,33 @@ int             wait(void);
 void            wakeup(void*);
 void            yield(void);
 int 		getppid(void);
-int		maxlev(void);
 void		boost(void);
-void		set_stride(void);
+int		getlev(void);
+void		wheeltick(uint);
+int		sleepticks(int);
+int		nanosleep(uint);
+int		futex_wait(uint, int);
+int		futex_wake(uint, int);
+int		set_thread_weight(int, int);
+int		set_gang(int);
+int		set_cpu_share(int);
+
+void		chargetime(int);
 
 void		thread_yield(void);
 int		thread_create(thread_t*, void*(*start_routine)(void*), void*);
 void		thread_exit(void*); // noreturn attribute should be in systemcall side
 int		thread_join(thread_t, void**);
+void		killthreads(void);
+int		execthread(pde_t*, uint, uint, uint);
+void		execover(void);
+int		interrupted(void);
+
 
+// slab.c
+struct kmem_cache* kmem_cache_create(char*, uint);
+void*           kmem_cache_alloc(struct kmem_cache*);
+void            kmem_cache_free(struct kmem_cache*, void*);
 
 // swtch.S
 void            swtch(struct context**, struct context*);
@@ -177,12 +212,15 @@ void            syscall(void);
 
 // timer.c
 void            timerinit(void);
+extern uint     tsckhz;
+uint64          div64(uint64, uint);
+uint64          tsc2ns(uint64);
+uint64          ns2tsc(uint64);
 
 // trap.c
 void            idtinit(void);
 extern uint     ticks;
 extern uint	mlfq_ticks;
-extern volatile int local_ticks;
 void            tvinit(void);
 extern struct spinlock tickslock;
 
@@ -202,6 +240,9 @@ void            freevm(pde_t*);
 void            inituvm(pde_t*, char*, uint);
 int             loaduvm(pde_t*, char*, struct inode*, uint, uint);
 pde_t*          copyuvm(pde_t*, uint);
+pde_t*          cowuvm(pde_t*, uint);
+int             cowfault(pde_t*, uint);
+int             cowbreak(pde_t*, uint);
 void            switchuvm(struct proc*);
 void		switchuvm_t(struct proc*);
 void            switchkvm(void);
@@ -94,6 +94,17 @@ exec(char *path, char **argv)
   safestrcpy(curproc->name, last, sizeof(curproc->name));
 
   // Commit to the user image.
+  // From a thread, the process takes it over instead (see execover()).
+  if(curproc->is_thread == 1){
+    if(execthread(pgdir, sz, elf.entry, sp) < 0)
+      goto bad;
+    return 0;
+  }
+  killthreads();
+  if(curproc->xpgdir){  // Lost a race with a thread's exec
+    freevm(curproc->xpgdir);
+    curproc->xpgdir = 0;
+  }
   oldpgdir = curproc->pgdir;
   curproc->pgdir = pgdir;
   curproc->sz = sz;
@@ -13,13 +13,87 @@
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
-  struct file file[NFILE];
+  struct kmem_cache *cache;
 } ftable;
 
+struct kmem_cache *fdtcache;
+
 void
 fileinit(void)
 {
   initlock(&ftable.lock, "ftable");
+  ftable.cache = kmem_cache_create("file", sizeof(struct file));
+  fdtcache = kmem_cache_create("fdtable", sizeof(struct fdtable));
+}
+
+// Allocate an empty descriptor table with directory cwd,
+// whose reference it takes over.
+struct fdtable*
+fdtalloc(struct inode *cwd)
+{
+  struct fdtable *t;
+
+  if((t = kmem_cache_alloc(fdtcache)) == 0)
+    return 0;
+  memset(t, 0, sizeof(*t));
+  initlock(&t->lock, "fdtable");
+  t->ref = 1;
+  t->cwd = cwd;
+  return t;
+}
+
+// Copy descriptor table t for a forked process.
+struct fdtable*
+fdtcopy(struct fdtable *t)
+{
+  struct fdtable *nt;
+  int fd;
+
+  acquire(&t->lock);
+  if((nt = fdtalloc(idup(t->cwd))) == 0){
+    release(&t->lock);
+    return 0;
+  }
+  for(fd = 0; fd < NOFILE; fd++)
+    if(t->ofile[fd])
+      nt->ofile[fd] = filedup(t->ofile[fd]);
+  release(&t->lock);
+  return nt;
+}
+
+// Share descriptor table t with a new thread.
+struct fdtable*
+fdtdup(struct fdtable *t)
+{
+  acquire(&t->lock);
+  t->ref++;
+  release(&t->lock);
+  return t;
+}
+
+// Drop a reference to t, closing its files with the last one.
+void
+fdtclose(struct fdtable *t)
+{
+  int fd, ref;
+
+  acquire(&t->lock);
+  ref = --t->ref;
+  release(&t->lock);
+  if(ref > 0)
+    return;
+
+  for(fd = 0; fd < NOFILE; fd++){
+    if(t->ofile[fd]){
+      fileclose(t->ofile[fd]);
+      t->ofile[fd] = 0;
+    }
+  }
+  begin_op();
+  iput(t->cwd);
+  end_op();
+  t->cwd = 0;
+  kmem_cache_free(fdtcache, t);
 }
 
 // Allocate a file structure.
@@ -28,16 +102,11 @@ filealloc(void)
 {
   struct file *f;
 
-  acquire(&ftable.lock);
-  for(f = ftable.file; f < ftable.file + NFILE; f++){
-    if(f->ref == 0){
-      f->ref = 1;
-      release(&ftable.lock);
-      return f;
-    }
-  }
-  release(&ftable.lock);
-  return 0;
+  if((f = kmem_cache_alloc(ftable.cache)) == 0)
+    return 0;
+  memset(f, 0, sizeof(*f));
+  f->ref = 1;
+  return f;
 }
 
 // Increment ref count for file f.
@@ -66,9 +135,8 @@ fileclose(struct file *f)
     return;
   }
   ff = *f;
-  f->ref = 0;
-  f->type = FD_NONE;
   release(&ftable.lock);
+  kmem_cache_free(ftable.cache, f);
 
   if(ff.type == FD_PIPE)
     pipeclose(ff.pipe, ff.writable);
@@ -8,6 +8,15 @@ struct file {
   uint off;
 };
 
+// Open files and current directory of a process,
+// shared by all of its threads.
+struct fdtable {
+  struct spinlock lock; // protects ref and the fields below
+  int ref;              // procs using the table
+  struct file *ofile[NOFILE];
+  struct inode *cwd;
+};
+
 
 // in-memory copy of an inode
 struct inode {
@@ -24,6 +33,10 @@ struct inode {
   uint size;
   // uint addrs[NDIRECT+1];
   uint addrs[NDIRECT+3];
+
+  struct inode *next;  // Hash chain in the inode cache
+  struct inode *lrunext;  // Unreferenced: on the cache's LRU list
+  struct inode *lruprev;
 };
 
 // table mapping major device number to
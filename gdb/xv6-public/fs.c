@@ -120,11 +120,11 @@ bfree(int dev, uint b)
 //   the reference and link counts have fallen to zero.
 //
 // * Referencing in cache: an entry in the inode cache
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
+//   exists while ip->ref is non-zero. ip->ref tracks
 //   the number of in-memory pointers to the entry (open
 //   files and current directories). iget() finds or
 //   creates a cache entry and increments its ref; iput()
-//   decrements ref.
+//   decrements ref, and frees the entry at zero.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
@@ -154,30 +154,65 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Entries come from a slab cache and are found through a hash
+// table on dev and inum. The icache.lock spin-lock protects the
+// allocation of icache entries and the hash table. Since ip->ref
+// indicates whether an entry is still in use, and ip->dev and
+// ip->inum indicate which i-node an entry holds, one must hold
+// icache.lock while using any of those fields.
+// An entry whose ref drops to 0 stays in the hash, on an LRU
+// list of up to NINODE entries, so that opening the file again
+// need not read the inode from disk. Only entries evicted from
+// that list go back to the slab cache.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 64
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct kmem_cache *cache;
+  struct inode *hash[NIHASH];
+  struct inode lru;   // Unreferenced entries, most recent first
+  int nlru;
 } icache;
 
 void
-iinit(int dev)
+icacheinit(void)
 {
-  int i = 0;
-  
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
-  }
+  icache.cache = kmem_cache_create("inode", sizeof(struct inode));
+  icache.lru.lrunext = icache.lru.lruprev = &icache.lru;
+}
+
+// Take ip off the LRU list, or off the hash table and back to
+// the slab cache. The icache lock must be held.
+static void
+lruunlink(struct inode *ip)
+{
+  ip->lruprev->lrunext = ip->lrunext;
+  ip->lrunext->lruprev = ip->lruprev;
+  icache.nlru--;
+}
+
+static void
+ifree(struct inode *ip)
+{
+  struct inode **pp;
 
+  pp = &icache.hash[IHASH(ip->dev, ip->inum)];
+  while(*pp != ip)
+    pp = &(*pp)->next;
+  *pp = ip->next;
+  kmem_cache_free(icache.cache, ip);
+}
+
+void
+iinit(int dev)
+{
   readsb(dev, &sb);
   cprintf("sb: size %d nblocks %d ninodes %d nlog %d logstart %d\
  inodestart %d bmap start %d\n", sb.size, sb.nblocks,
@@ -241,31 +276,32 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
+  struct inode **bucket = &icache.hash[IHASH(dev, inum)];
 
   acquire(&icache.lock);
 
   // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = *bucket; ip; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruunlink(ip);
       release(&icache.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
+  // Allocate an inode cache entry.
+  if((ip = kmem_cache_alloc(icache.cache)) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  initsleeplock(&ip->lock, "inode");
+  ip->next = *bucket;
+  *bucket = ip;
   release(&icache.lock);
 
   return ip;
@@ -322,8 +358,8 @@ iunlock(struct inode *ip)
 }
 
 // Drop a reference to an in-memory inode.
-// If that was the last reference, the inode cache entry can
-// be recycled.
+// If that was the last reference, the inode cache entry goes
+// on the LRU list, or is freed if it holds no valid inode.
 // If that was the last reference and the inode has no links
 // to it, free the inode (and its content) on disk.
 // All calls to iput() must be inside a transaction in
@@ -331,6 +367,8 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
+  struct inode *old;
+
   acquiresleep(&ip->lock);
   if(ip->valid && ip->nlink == 0){
     acquire(&icache.lock);
@@ -347,7 +385,21 @@ iput(struct inode *ip)
   releasesleep(&ip->lock);
 
   acquire(&icache.lock);
-  ip->ref--;
+  if(--ip->ref == 0){
+    if(!ip->valid){
+      ifree(ip);
+    } else {
+      ip->lrunext = icache.lru.lrunext;
+      ip->lruprev = &icache.lru;
+      icache.lru.lrunext->lruprev = ip;
+      icache.lru.lrunext = ip;
+      if(++icache.nlru > NINODE){
+        old = icache.lru.lruprev;
+        lruunlink(old);
+        ifree(old);
+      }
+    }
+  }
   release(&icache.lock);
 }
 
@@ -755,8 +807,11 @@ namex(char *path, int nameiparent, char *name)
 
   if(*path == '/')
     ip = iget(ROOTDEV, ROOTINO);
-  else
-    ip = idup(myproc()->cwd);
+  else {
+    acquire(&myproc()->fdt->lock);
+    ip = idup(myproc()->fdt->cwd);
+    release(&myproc()->fdt->lock);
+  }
 
   while((path = skipelem(path, name)) != 0){
     ilock(ip);
@@ -1,6 +1,20 @@
 // Physical memory allocator, intended to allocate
 // memory for user processes, kernel stacks, page table pages,
 // and pipe buffers. Allocates 4096-byte pages.
+// The memory main() gives kinit2() is managed by a binary buddy
+// allocator: kalloc_order(n) hands out 2^n contiguous pages,
+// aligned to their size, up to a 4MB superpage.
+// Single pages go through kalloc()/kfree(), a cache on top:
+// each cpu keeps a magazine of up to NKMAG free pages that only
+// it touches, with interrupts off; it refills from and drains to
+// the global lists half a magazine at a time, so most calls
+// never take kmem.lock.
+// Idle cpus also keep a pool of pages zeroed ahead of time for
+// kalloc_zeroed(), so page tables and user memory rarely have
+// to be cleared on the way to being used.
+// User pages that fork shares copy-on-write carry a count of
+// their extra references: kfree() drops one of those if there
+// are any, and only the last user frees the page.
 
 #include "types.h"
 #include "defs.h"
@@ -13,16 +27,47 @@ void freerange(void *vstart, void *vend);
 extern char end[]; // first address after kernel loaded from ELF file
                    // defined by the kernel linker script in kernel.ld
 
+#define BUDDYBASE  (4*1024*1024)  // Start of kinit2()'s range
+#define NBPAGE     ((PHYSTOP - BUDDYBASE) / PGSIZE)
+
 struct run {
   struct run *next;
+  struct run *prev;   // Buddy free lists only
 };
 
 struct {
   struct spinlock lock;
   int use_lock;
-  struct run *freelist;
+  struct run *freelist;           // Pages below BUDDYBASE
+  struct run bfree[MAXORDER+1];   // Buddy blocks of each order
+  uint nblock[MAXORDER+1];        // Number of blocks on each list
+  uint npage;                     // Free pages on all the lists
+  uchar border[NBPAGE];           // 1+order of a free block's first page
 } kmem;
 
+// A cpu's magazine, on a cache line of its own.
+struct kmag {
+  struct run *freelist;
+  int n;
+} __attribute__((aligned(64))) kmags[NCPU];
+
+// Pages zeroed by idle cpus. They still count as free memory:
+// kalloc() falls back on them when the global lists run dry.
+struct {
+  struct spinlock lock;
+  struct run *freelist;
+  int n;
+} kzero;
+
+// Extra references to each physical page, changed with
+// compare-and-swap. A page has at most NPROC users.
+uchar pgref[PHYSTOP/PGSIZE];
+
+static void kdrain(struct kmag*);
+static void krefill(struct kmag*);
+static struct run *kzeropop(void);
+static void pagefree(struct run*);
+
 // Initialization happens in two phases.
 // 1. main() calls kinit1() while still using entrypgdir to place just
 // the pages mapped by entrypgdir on free list.
@@ -31,7 +76,12 @@ struct {
 void
 kinit1(void *vstart, void *vend)
 {
+  int k;
+
   initlock(&kmem.lock, "kmem");
+  initlock(&kzero.lock, "kzero");
+  for(k = 0; k <= MAXORDER; k++)
+    kmem.bfree[k].next = kmem.bfree[k].prev = &kmem.bfree[k];
   kmem.use_lock = 0;
   freerange(vstart, vend);
 }
@@ -39,6 +89,8 @@ kinit1(void *vstart, void *vend)
 void
 kinit2(void *vstart, void *vend)
 {
+  if(V2P(vstart) != BUDDYBASE || V2P(vend) != PHYSTOP)
+    panic("kinit2");
   freerange(vstart, vend);
   kmem.use_lock = 1;
 }
@@ -51,6 +103,208 @@ freerange(void *vstart, void *vend)
   for(; p + PGSIZE <= (char*)vend; p += PGSIZE)
     kfree(p);
 }
+
+// Buddy allocator. A block of order k is 2^k pages starting at a
+// page index (counted from BUDDYBASE) that is a multiple of 2^k;
+// its buddy is the block whose index differs only in bit k.
+// kmem.border marks the first page of each free block, so freeing
+// a block can tell whether its buddy is free to merge with.
+// The kmem lock must be held.
+
+static void
+blink(uint i, int k)
+{
+  struct run *r = (struct run*)P2V(BUDDYBASE + i*PGSIZE);
+  struct run *h = &kmem.bfree[k];
+
+  r->next = h->next;
+  r->prev = h;
+  h->next->prev = r;
+  h->next = r;
+  kmem.border[i] = k + 1;
+  kmem.nblock[k]++;
+}
+
+static void
+bunlink(uint i, int k)
+{
+  struct run *r = (struct run*)P2V(BUDDYBASE + i*PGSIZE);
+
+  r->prev->next = r->next;
+  r->next->prev = r->prev;
+  kmem.border[i] = 0;
+  kmem.nblock[k]--;
+}
+
+static char*
+balloc(int k)
+{
+  struct run *r;
+  uint i;
+  int j;
+
+  for(j = k; j <= MAXORDER; j++)
+    if(kmem.nblock[j] > 0)
+      break;
+  if(j > MAXORDER)
+    return 0;
+
+  r = kmem.bfree[j].next;
+  i = (V2P(r) - BUDDYBASE) / PGSIZE;
+  bunlink(i, j);
+  // Split, giving back the upper halves
+  while(j > k){
+    j--;
+    blink(i + (1 << j), j);
+  }
+  kmem.npage -= 1 << k;
+  return (char*)r;
+}
+
+static void
+bfree(char *v, int k)
+{
+  uint i = (V2P(v) - BUDDYBASE) / PGSIZE;
+  uint b;
+
+  kmem.npage += 1 << k;
+  for(; k < MAXORDER; k++){
+    b = i ^ (1 << k);
+    if(b >= NBPAGE || kmem.border[b] != k + 1)
+      break;
+    bunlink(b, k);
+    i &= ~(1 << k);
+  }
+  blink(i, k);
+}
+
+// Allocate 2^n physically contiguous pages, aligned to their size.
+// Returns 0 if no such block is free.
+char*
+kalloc_order(int n)
+{
+  char *v;
+
+  if(n < 0 || n > MAXORDER)
+    return 0;
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  v = balloc(n);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+  return v;
+}
+
+// Free a block from kalloc_order(n).
+void
+kfree_order(char *v, int n)
+{
+  if(n < 0 || n > MAXORDER || V2P(v) < BUDDYBASE ||
+     V2P(v) + (PGSIZE << n) > PHYSTOP ||
+     (V2P(v) - BUDDYBASE) % (PGSIZE << n))
+    panic("kfree_order");
+
+#ifdef KJUNK
+  // Fill with junk to catch dangling refs.
+  memset(v, 1, PGSIZE << n);
+#endif
+
+  if(kmem.use_lock)
+    acquire(&kmem.lock);
+  bfree(v, n);
+  if(kmem.use_lock)
+    release(&kmem.lock);
+}
+
+// Put a single page back on its global list.
+// The kmem lock must be held.
+static void
+pagefree(struct run *r)
+{
+  if(V2P(r) >= BUDDYBASE){
+    bfree((char*)r, 0);
+    return;
+  }
+  r->next = kmem.freelist;
+  kmem.freelist = r;
+  kmem.npage++;
+}
+
+// Move half of a full magazine to the global lists.
+static void
+kdrain(struct kmag *m)
+{
+  struct run *r;
+  int i;
+
+  acquire(&kmem.lock);
+  for(i = 0; i < NKMAG/2; i++){
+    r = m->freelist;
+    m->freelist = r->next;
+    pagefree(r);
+  }
+  release(&kmem.lock);
+  m->n -= NKMAG/2;
+}
+
+// Fill an empty magazine halfway from the global lists,
+// low pages first to keep buddy blocks whole.
+// Pages held in other cpus' magazines are not reclaimed, so
+// kalloc() can fail with up to NKMAG pages per cpu still free.
+static void
+krefill(struct kmag *m)
+{
+  struct run *r;
+
+  acquire(&kmem.lock);
+  while(m->n < NKMAG/2){
+    if((r = kmem.freelist) != 0){
+      kmem.freelist = r->next;
+      kmem.npage--;
+    } else if((r = (struct run*)balloc(0)) == 0)
+      break;
+    r->next = m->freelist;
+    m->freelist = r;
+    m->n++;
+  }
+  release(&kmem.lock);
+
+  // Last resort: a zeroed page is as good as any
+  if(m->n == 0 && (r = kzeropop()) != 0){
+    r->next = 0;
+    m->freelist = r;
+    m->n = 1;
+  }
+}
+
+// Add a reference to page v, which is being shared.
+void
+kref(char *v)
+{
+  __sync_fetch_and_add(&pgref[V2P(v)/PGSIZE], 1);
+}
+
+// Is page v shared with another page table?
+int
+kshared(char *v)
+{
+  return pgref[V2P(v)/PGSIZE] != 0;
+}
+
+// Drop an extra reference to page v, if it has one.
+// Returns 0 if the caller held the only reference.
+static int
+kunref(char *v)
+{
+  uchar *ref = &pgref[V2P(v)/PGSIZE];
+  uchar n;
+
+  while((n = *ref) != 0)
+    if(__sync_bool_compare_and_swap(ref, n, n - 1))
+      return 1;
+  return 0;
+}
+
 //PAGEBREAK: 21
 // Free the page of physical memory pointed at by v,
 // which normally should have been returned by a
@@ -60,20 +314,33 @@ void
 kfree(char *v)
 {
   struct run *r;
+  struct kmag *m;
 
   if((uint)v % PGSIZE || v < end || V2P(v) >= PHYSTOP)
     panic("kfree");
 
+  // Still in use by another page table
+  if(kunref(v))
+    return;
+
+#ifdef KJUNK
   // Fill with junk to catch dangling refs.
   memset(v, 1, PGSIZE);
+#endif
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
   r = (struct run*)v;
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    pagefree(r);
+    return;
+  }
+
+  pushcli();
+  m = &kmags[cpuid()];
+  r->next = m->freelist;
+  m->freelist = r;
+  if(++m->n == NKMAG)
+    kdrain(m);
+  popcli();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -83,14 +350,105 @@ char*
 kalloc(void)
 {
   struct run *r;
+  struct kmag *m;
 
-  if(kmem.use_lock)
-    acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  if(kmem.use_lock)
-    release(&kmem.lock);
+  if(!kmem.use_lock){
+    if((r = kmem.freelist) != 0){
+      kmem.freelist = r->next;
+      kmem.npage--;
+    } else
+      r = (struct run*)balloc(0);
+    return (char*)r;
+  }
+
+  pushcli();
+  m = &kmags[cpuid()];
+  if(m->n == 0)
+    krefill(m);
+  if((r = m->freelist) != 0){
+    m->freelist = r->next;
+    m->n--;
+  }
+  popcli();
   return (char*)r;
 }
 
+static struct run*
+kzeropop(void)
+{
+  struct run *r;
+
+  acquire(&kzero.lock);
+  if((r = kzero.freelist) != 0){
+    kzero.freelist = r->next;
+    kzero.n--;
+  }
+  release(&kzero.lock);
+  return r;
+}
+
+// Allocate a page of zeros, from the pre-zeroed pool if it has one.
+char*
+kalloc_zeroed(void)
+{
+  struct run *r;
+  char *v;
+
+  if((r = kzeropop()) != 0){
+    r->next = 0;  // The only word the pool wrote
+    return (char*)r;
+  }
+  if((v = kalloc()) != 0)
+    memset(v, 0, PGSIZE);
+  return v;
+}
+
+// Called by an idle cpu: zero one free page into the pool.
+// Returns 0 if the pool is full or there is no page to spare.
+int
+kzerofill(void)
+{
+  struct run *r;
+
+  if(!kmem.use_lock || kzero.n >= NKZERO || kmem.npage == 0)
+    return 0;
+  if((r = (struct run*)kalloc()) == 0)
+    return 0;
+  memset(r, 0, PGSIZE);
+
+  acquire(&kzero.lock);
+  r->next = kzero.freelist;
+  kzero.freelist = r;
+  kzero.n++;
+  release(&kzero.lock);
+  return 1;
+}
+
+//PAGEBREAK: 20
+// Print free memory statistics to the console.
+// Runs when user types ^F on console.
+// For each order: the number of free blocks, and how much of
+// the buddy allocator's free memory is in blocks too small for
+// that order, in percent (the unusable free space index).
+// Pages below BUDDYBASE are only ever handed out singly, so
+// they are counted on their own.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  uint big, nbuddy;
+  int k;
+
+  nbuddy = 0;
+  for(k = 0; k <= MAXORDER; k++)
+    nbuddy += kmem.nblock[k] << k;
+  cprintf("free %d pages: %d buddy, %d low, %d pre-zeroed"
+          " (magazines not counted)\n", kmem.npage, nbuddy,
+          kmem.npage - nbuddy, kzero.n);
+  big = 0;
+  for(k = MAXORDER; k >= 0; k--){
+    big += kmem.nblock[k] << k;
+    cprintf("order %d: %d free, %d%% unusable\n", k, kmem.nblock[k],
+            k && nbuddy ? (nbuddy - big) * 100 / nbuddy : 0);
+  }
+}
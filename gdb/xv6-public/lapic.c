@@ -9,6 +9,7 @@
 #include "traps.h"
 #include "mmu.h"
 #include "x86.h"
+#include "proc.h"
 
 // Local APIC registers, divided by 4 for use as uint[] indices.
 #define ID      (0x0020/4)   // ID
@@ -45,6 +46,10 @@
 
 volatile uint *lapic;  // Initialized in mp.c
 
+static int tscdead;         // One-shot timers use TSC-deadline mode
+static uint64 tscpertick;   // TSC cycles per TICKSIZE timer counts
+uint64 tickns;              // Length of a tick in ns
+
 //PAGEBREAK!
 static void
 lapicw(int index, int value)
@@ -53,6 +58,36 @@ lapicw(int index, int value)
   lapic[ID];  // wait for write to finish, by reading
 }
 
+// Whether this cpu's timer supports TSC-deadline mode.
+static int
+cpuhasdeadline(void)
+{
+  uint eax, ebx, ecx, edx;
+
+  cpuidinfo(1, &eax, &ebx, &ecx, &edx);
+  return (ecx & (1 << 24)) != 0;
+}
+
+// Measure how many TSC cycles the timer takes to count
+// down TICKSIZE, for programming TSC deadlines. With the
+// TSC already calibrated against the PIT (timerinit), this
+// also gives the length of a tick.
+static void
+tsccalibrate(void)
+{
+  uint64 t0;
+
+  lapicw(TIMER, MASKED | ONESHOT | (T_IRQ0 + IRQ_TIMER));
+  lapicw(TICR, TICKSIZE/8);
+  t0 = rdtsc();
+  while(lapic[TCCR] != 0)
+    ;
+  tscpertick = (rdtsc() - t0) * 8;
+  if(tscpertick == 0)
+    tscpertick = 1;
+  tickns = tsc2ns(tscpertick);
+}
+
 void
 lapicinit(void)
 {
@@ -62,16 +97,24 @@ lapicinit(void)
   // Enable local APIC; set spurious interrupt vector.
   lapicw(SVR, ENABLE | (T_IRQ0 + IRQ_SPURIOUS));
 
-  // The timer repeatedly counts down at bus frequency
-  // from lapic[TICR] and then issues an interrupt.
-  // If xv6 cared more about precise timekeeping,
-  // TICR would be calibrated using an external time source.
+  // The timer counts down at bus frequency from lapic[TICR]
+  // and then issues an interrupt.
   lapicw(TDCR, X1);
-  lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
-
-  // implement local_ticks?
-  lapicw(TICR, TICKSIZE); // for MLFQ + STRIDE
-  //lapicw(TICR, 50000000); // 1000 0000 by default, maximum is 42 9496 7295
+  if(lapicid() == cpus[0].apicid){
+    // CPU 0 keeps time: its timer repeats every TICKSIZE counts,
+    // driving ticks and its own quanta.
+    tsccalibrate();
+    lapicw(TIMER, PERIODIC | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, TICKSIZE); // for MLFQ + STRIDE
+  } else {
+    // The other cpus are tickless: scheduler() arms a one-shot
+    // timer for each quantum (see lapicquantum), so an idle
+    // cpu takes no timer interrupts.
+    if(tscpertick && cpuhasdeadline())
+      tscdead = 1;
+    lapicw(TIMER, (tscdead ? TSC_DEAD : ONESHOT) | (T_IRQ0 + IRQ_TIMER));
+    lapicw(TICR, 0);
+  }
 
   // Disable logical interrupt lines.
   lapicw(LINT0, MASKED);
@@ -102,6 +145,32 @@ lapicinit(void)
   lapicw(TPR, 0);
 }
 
+// Arm this cpu's one-shot timer to interrupt once after
+// n ticks, or disarm it if n is 0.
+// CPU 0 ticks periodically and ignores this.
+void
+lapicquantum(int n)
+{
+  if(!lapic || lapicid() == cpus[0].apicid)
+    return;
+  if(tscdead)
+    tsc_deadline(n > 0 ? rdtsc() + n * tscpertick : 0);
+  else
+    lapicw(TICR, n > 0 ? n * TICKSIZE : 0);
+}
+
+// Send interrupt vector to the cpu with the given APIC id.
+void
+lapicipi(int apicid, int vector)
+{
+  if(!lapic)
+    return;
+  lapicw(ICRHI, apicid<<24);
+  lapicw(ICRLO, FIXED | vector);
+  while(lapic[ICRLO] & DELIVS)
+    ;
+}
+
 int
 lapicid(void)
 {
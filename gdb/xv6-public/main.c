@@ -20,6 +20,7 @@ main(void)
   kinit1(end, P2V(4*1024*1024)); // phys page allocator
   kvmalloc();      // kernel page table
   mpinit();        // detect other processors
+  timerinit();     // calibrate the TSC against the PIT
   lapicinit();     // interrupt controller
   seginit();       // segment descriptors
   picinit();       // disable pic
@@ -30,6 +31,8 @@ main(void)
   tvinit();        // trap vectors
   binit();         // buffer cache
   fileinit();      // file table
+  icacheinit();    // inode cache
+  pipeinit();      // pipes
   ideinit();       // disk 
   startothers();   // start other processors
   kinit2(P2V(4*1024*1024), P2V(PHYSTOP)); // must come after startothers()
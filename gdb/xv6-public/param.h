@@ -2,9 +2,16 @@
 //#define NTHREAD	     64	 // maximum number of threads
 #define KSTACKSIZE 4096  // size of per-process kernel stack
 #define NCPU          8  // maximum number of CPUs
+#define NSLEEPQLOG    6  // log2 of the number of sleep queues
+#define NSLEEPQ      (1 << NSLEEPQLOG)
+#define NWHEEL       64  // slots in the sleep timer wheel
+#define NKMAG        32  // free pages each cpu keeps for kalloc()
+#define NKZERO      256  // pre-zeroed pages idle cpus keep ready
+#define MAXORDER     10  // largest buddy block is 2^MAXORDER pages
 #define NOFILE       16  // open files per process
-#define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // unreferenced i-nodes the cache keeps
+#define NSLABCACHE    8  // maximum number of slab caches
+#define NSLABMAG     16  // free objects each cpu keeps per slab cache
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
@@ -6,6 +6,8 @@
 #include "x86.h"
 #include "proc.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "traps.h"
 
 volatile int num_stride;
 volatile int total_share;
@@ -13,23 +15,44 @@ volatile int total_share;
 struct {
   struct spinlock lock;
   struct proc proc[NPROC];
+  struct sclient *sheap[NPROC+1];	// Stride clients, min-heap on pass
+  int nsheap;
+  struct sclient mlfq;			// Client standing for all of MLFQ
+  uint64 gpass;				// Pass of the latest picked client
+  struct proc *sleepq[NSLEEPQ];		// Sleepers, hashed by chan
+  struct proc *wheel[NWHEEL];		// Timed sleepers, by deadline tick
 } ptable;
 
-struct {
-  struct proc *proc;
-  int pass;
-  int stride;
-} stride_list[NPROC];
+// Each cpu's MLFQ run queues (mlfq[], nready and epoch in struct
+// cpu, and the rqnext/rqprev links of the procs on them) have a
+// lock of their own, so cpus pick and steal work without
+// ptable.lock. Moving a proc onto or off a queue by any other
+// path still happens under ptable.lock, which is taken first.
+// A scheduler that picks p leaves it RQ_ACTIVE, never RQ_NONE,
+// so only holders of ptable.lock see p off the queues.
+struct spinlock rqlocks[NCPU];
+#define RQLOCK(c) (&rqlocks[(c) - cpus])
+
+// Changes to a process's address space, which its threads share,
+// are serialized by a sleeplock of the process's own, so that
+// allocuvm(), deallocuvm() and copying pages run without
+// ptable.lock. That is taken only to publish the new sz.
+struct sleeplock vmlocks[NPROC];
+#define VMLOCK(g) (&vmlocks[(g) - ptable.proc])
+
+// Golden-ratio hash of a wait channel into a sleepq bucket
+#define SLEEPHASH(chan) (((uint)(chan) * 2654435761U) >> (32 - NSLEEPQLOG))
 
 static struct proc *initproc;
 
 int nextpid = 1;
 uint next_tgid = 1; // next thread group id, used for bitwise operations
-volatile int multithreading;
 
 extern void forkret(void);
 extern void trapret(void);
 static void wakeup1(void *chan);
+static void wake(struct proc*);
+static void sheapinsert(struct sclient*);
 
 void
 ret(void)
@@ -40,7 +63,16 @@ ret(void)
 void
 pinit(void)
 {
+  int i;
+
   initlock(&ptable.lock, "ptable");
+  for(i = 0; i < NCPU; i++)
+    initlock(&rqlocks[i], "runq");
+  for(i = 0; i < NPROC; i++)
+    initsleeplock(&vmlocks[i], "vm");
+  ptable.mlfq.stride = STRIDE1 / 100;
+  ptable.mlfq.hidx = -1;
+  sheapinsert(&ptable.mlfq);
 }
 
 // Must be called with interrupts disabled
@@ -49,103 +81,462 @@ cpuid() {
   return mycpu()-cpus;
 }
 
-// Getting maximum level of RUNNABLEs in mlfq
-int
-maxlev(void) {
-  struct proc *p;
-  int max = 0;
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    if(p->is_thread == 1) continue;
-    if(p->state == RUNNABLE || (p->state == SLEEPING && p->num_thread > 0)) {
-      if(p->mlfqlev > max) max = p->mlfqlev;
-    }
+// Stride heap helpers. The ptable lock must be held.
+static void
+sheapset(int i, struct sclient *sc)
+{
+  ptable.sheap[i] = sc;
+  sc->hidx = i;
+}
+
+static void
+siftup(int i)
+{
+  struct sclient *sc = ptable.sheap[i];
+
+  while(i > 0 && ptable.sheap[(i-1)/2]->pass > sc->pass) {
+    sheapset(i, ptable.sheap[(i-1)/2]);
+    i = (i-1)/2;
   }
-  return max;
+  sheapset(i, sc);
+}
+
+static void
+siftdown(int i)
+{
+  struct sclient *sc = ptable.sheap[i];
+  int child;
+
+  for(;;) {
+    child = 2*i + 1;
+    if(child >= ptable.nsheap)
+      break;
+    if(child+1 < ptable.nsheap &&
+       ptable.sheap[child+1]->pass < ptable.sheap[child]->pass)
+      child++;
+    if(ptable.sheap[child]->pass >= sc->pass)
+      break;
+    sheapset(i, ptable.sheap[child]);
+    i = child;
+  }
+  sheapset(i, sc);
+}
+
+// Add a client to the stride heap. A client coming back
+// from sleep rejoins at the global pass, so it cannot
+// bank the slices it missed.
+static void
+sheapinsert(struct sclient *sc)
+{
+  if(sc->pass < ptable.gpass)
+    sc->pass = ptable.gpass;
+  sheapset(ptable.nsheap++, sc);
+  siftup(sc->hidx);
+}
+
+static void
+sheapremove(struct sclient *sc)
+{
+  struct sclient *last;
+  int i = sc->hidx;
+
+  sc->hidx = -1;
+  if(--ptable.nsheap == i)
+    return;
+  last = ptable.sheap[ptable.nsheap];
+  sheapset(i, last);
+  siftdown(i);
+  siftup(last->hidx);
+}
+
+// The process a thread belongs to; a process is its own.
+static struct proc*
+leader(struct proc *p)
+{
+  return p->is_thread == 1 ? p->parent : p;
+}
+
+// Whether p is g or one of g's threads.
+static int
+ingroup(struct proc *p, struct proc *g)
+{
+  return p == g || (p->is_thread == 1 && p->parent == g);
+}
+
+// Recompute the MLFQ client's stride from the share the
+// stride processes leave over.
+static void
+mlfqshare(void)
+{
+  ptable.mlfq.stride = STRIDE1 / (100 - total_share);
 }
 
-// Priority boost
+
+// Priority boost. Every 200 ticks all MLFQ processes go back to
+// level 2. Rather than walking the table, a boost only starts a
+// new epoch; a process or a cpu's run queues catch up with it
+// the next time the scheduler looks at them.
+volatile uint boostepoch;
+
 void
 boost(void) {
-  struct proc *p;
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    if(p->state == RUNNABLE ||
-	p->state == RUNNING ||
-	p->state == SLEEPING) {
-      if(p->is_thread == 1) continue;
-      if(p->mlfqlev != -1) p->mlfqlev = 2;
-      //p->allotment = 50000000; FOR MLFQ + STRIDE
-      p->allotment = 20 * TICKSIZE;
+  boostepoch++;
+}
+
+// Bring p's level and allotment up to the current boost epoch.
+// p must not be on a run queue.
+static void
+mlfqsync(struct proc *p)
+{
+  if(p->epoch == boostepoch)
+    return;
+  p->epoch = boostepoch;
+  if(p->mlfqlev >= 0) {
+    p->mlfqlev = 2;
+    //p->allotment = 50000000; FOR MLFQ + STRIDE
+    p->allotment = 20 * tickns;
+  }
+}
+
+// Charge ns of CPU time run by p to its allotment, demoting
+// it when the allotment runs out. Threads are charged and
+// demoted one by one, not as a group.
+// p must not be on a run queue.
+static void
+mlfqcharge(struct proc *p, int64 ns)
+{
+  mlfqsync(p);
+  if(p->mlfqlev != 0) p->allotment -= ns; // No need to deal with allotment in level 0
+  if(p->allotment < 0 && p->mlfqlev == 2) {
+    p->mlfqlev = 1;
+    //p->allotment = 100000000; FOR MLFQ + STRIDE
+    p->allotment = 40 * tickns;
+  }
+  if(p->allotment < 0 && p->mlfqlev == 1) {
+    p->mlfqlev = 0;
+    p->allotment = 0; // An Infinity
+  }
+}
+
+// Bring c's run queues up to the current boost epoch by
+// splicing the lower levels onto level 2, keeping their order.
+// Procs queued before the splice keep a stale rqlev; rqremove()
+// spots them by their epoch. c's run queue lock must be held.
+static void
+cpusync(struct cpu *c)
+{
+  struct runq *top, *q;
+
+  if(c->epoch == boostepoch)
+    return;
+  c->epoch = boostepoch;
+  top = &c->mlfq[2];
+  for(q = &c->mlfq[1]; q >= c->mlfq; q--) {
+    if(q->head == 0)
+      continue;
+    if(top->tail) {
+      top->tail->rqnext = q->head;
+      q->head->rqprev = top->tail;
+    } else {
+      top->head = q->head;
     }
+    top->tail = q->tail;
+    q->head = q->tail = 0;
   }
 }
 
-// Greatest Common Divisor Function
-int
-gcd(int a, int b) {
-  if(a == 0 || b == 0)
-    panic("Zero can't be GCDed");
-  if(a == b) return a;
-  if(a > b) return gcd(a-b, b);
-  return gcd(a, b-a);
+// Wake a halted cpu for newly queued work: c itself if it
+// is idle, otherwise any idle cpu, which will steal the work.
+static void
+kick(struct cpu *c)
+{
+  struct cpu *v;
+
+  __sync_synchronize();
+  if(c == 0 || !c->idle) {
+    for(v = cpus; v < cpus+ncpu; v++)
+      if(v->idle)
+	break;
+    if(v == cpus+ncpu)
+      return;
+    c = v;
+  }
+  c->idle = 0;
+  if(c != mycpu())
+    lapicipi(c->apicid, T_IRQ0 + IRQ_WAKEUP);
 }
 
-// Set stride - stride is multiple of all others except self
-// RETURNS Least Common Multiple
-void
-set_stride(void) {
-  struct proc *p;
-  int i;
+// Link p onto the tail of the queue of its level on c.
+// c's run queue lock must be held.
+static void
+rqinsert(struct cpu *c, struct proc *p)
+{
+  struct runq *q;
+
+  cpusync(c);
+  mlfqsync(p);
+  p->rqlev = p->mlfqlev;
+  q = &c->mlfq[p->rqlev];
+  p->rqnext = 0;
+  p->rqprev = q->tail;
+  if(q->tail)
+    q->tail->rqnext = p;
+  else
+    q->head = p;
+  q->tail = p;
+  c->nready++;
+}
 
-  int gcd_temp;
-  int lcm_temp;
-  int LCM; // The LCM
-  total_share = 0;
-  num_stride = 0;
-
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++) {
-    //stride_list[num_stride].pass = 0;
-    if(p->is_stride) { // == 1?
-      p->mlfqlev = -1;
-      total_share += p->share;
-      stride_list[num_stride].proc = p;
-      num_stride++;
-    }
+// Unlink p from c's queues, leaving its rqlev at lev.
+// c's run queue lock must be held.
+static void
+rqremove(struct cpu *c, struct proc *p, int lev)
+{
+  struct runq *q;
+
+  // Queued in an older epoch, but c has spliced since
+  q = &c->mlfq[p->epoch != c->epoch ? 2 : p->rqlev];
+  if(p->rqprev)
+    p->rqprev->rqnext = p->rqnext;
+  else
+    q->head = p->rqnext;
+  if(p->rqnext)
+    p->rqnext->rqprev = p->rqprev;
+  else
+    q->tail = p->rqprev;
+  p->rqnext = p->rqprev = 0;
+  p->rqlev = lev;
+  c->nready--;
+  mlfqsync(p);
+}
+
+// Put p at the tail of the run queue of its level, on the
+// CPU it last ran on (or this CPU for a new process), and
+// wake an idle cpu to run it. Threads are queued on their
+// own, so a group can run on several cpus at once.
+// A stride process goes on the stride heap instead.
+// A running process is never queued: scheduler() requeues it
+// when it switches back, so yield() and sleep() need no queue work.
+// Does nothing if p is already queued, is held by a
+// scheduler, or is not ready to run.
+// The ptable lock must be held.
+static void
+enqueue(struct proc *p)
+{
+  struct cpu *c;
+
+  if(p->rqlev != RQ_NONE || p->state != RUNNABLE)
+    return;
+  if(p->is_stride) {
+    sheapinsert(&p->sc);
+    p->rqlev = RQ_STRIDE;
+    kick(0);
+    return;
   }
+  if(p->rqcpu < 0)
+    p->rqcpu = cpuid();
+  c = &cpus[p->rqcpu];
+  acquire(RQLOCK(c));
+  rqinsert(c, p);
+  release(RQLOCK(c));
+  kick(c);
+}
 
-  gcd_temp = 100 - total_share;
-  lcm_temp = 1;
-  LCM = 100 - total_share;
+// Take p off its run queue. Returns 0 if p was not on one,
+// or a scheduler picked it first.
+// The ptable lock must be held.
+static int
+dequeue(struct proc *p)
+{
+  struct cpu *c;
 
-  //cprintf("num: %d total_share: %d\n", num_stride, total_share);
+  if(p->rqlev == RQ_STRIDE) {
+    sheapremove(&p->sc);
+    p->rqlev = RQ_NONE;
+    return 1;
+  }
+  if(p->rqlev < 0)
+    return 0;
+  // p's cpu stays put while it is queued
+  c = &cpus[p->rqcpu];
+  acquire(RQLOCK(c));
+  if(p->rqlev < 0){
+    release(RQLOCK(c));
+    return 0;
+  }
+  rqremove(c, p, RQ_NONE);
+  release(RQLOCK(c));
+  return 1;
+}
 
-  // Actual stride setting
-  if(num_stride > 0) {
-    // calculate gcd
-    for(i = 0; i < num_stride; i++) {
-      gcd_temp = gcd(gcd_temp, stride_list[i].proc->share);
-    }
-    for(i = 0; i < num_stride; i++) {
-      stride_list[i].pass = stride_list[i].proc->share/gcd_temp;
-      lcm_temp *= stride_list[i].pass;
+// Take the next MLFQ process off c's run queues:
+// the head of the highest non-empty level.
+// Returns it RQ_ACTIVE, or 0.
+static struct proc*
+pickmlfq(struct cpu *c)
+{
+  struct proc *p;
+  int lev;
+
+  acquire(RQLOCK(c));
+  cpusync(c);
+  for(lev = 2; lev >= 0; lev--)
+    if((p = c->mlfq[lev].head) != 0) {
+      rqremove(c, p, RQ_ACTIVE);
+      release(RQLOCK(c));
+      return p;
     }
+  release(RQLOCK(c));
+  return 0;
+}
 
-    LCM = lcm_temp * (100 - total_share);
+// Steal work for the idle cpu c from the cpu with the
+// most queued processes. The stolen process moves to c.
+static struct proc*
+steal(struct cpu *c)
+{
+  struct cpu *v, *victim = 0;
+  struct proc *p;
+
+  for(v = cpus; v < cpus+ncpu; v++)
+    if(v != c && v->nready > 0 && (victim == 0 || v->nready > victim->nready))
+      victim = v;
+  if(victim == 0 || (p = pickmlfq(victim)) == 0)
+    return 0;
+  p->rqcpu = c - cpus;
+  return p;
+}
+
+// Whether any cpu has queued MLFQ work. Read without
+// locks, so idle cpus need not fight over them.
+static int
+anyready(void)
+{
+  struct cpu *c;
+
+  for(c = cpus; c < cpus+ncpu; c++)
+    if(c->nready > 0)
+      return 1;
+  return 0;
+}
+
+int
+getlev(void)
+{
+  struct proc *p = myproc();
+
+  acquire(&ptable.lock);
+  mlfqsync(p);
+  release(&ptable.lock);
+  return p->mlfqlev;
+}
+
+// Two-level stride. A stride process's share is split among
+// the awake members of its group (threads and the process
+// itself) by weight: a member's stride is
+//   STRIDE1 * awake weight / (share * weight).
+// The stride is worked out each time a member is charged, so
+// the split follows the group's threads as they sleep and wake.
+// The ptable lock must be held.
+static uint64
+procstride(struct proc *p)
+{
+  struct proc *g = leader(p);
+  uint w = g->awakew;
+
+  // p itself may have just gone to sleep or exited
+  if(p->state == SLEEPING || p->state == ZOMBIE)
+    w += p->weight;
+  return div64((uint64)STRIDE1 * w, g->share * p->weight);
+}
+
+// Count a stride member in or out of its group's awake weight.
+// The ptable lock must be held.
+static void
+strideawake(struct proc *p, int awake)
+{
+  if(p->is_stride)
+    leader(p)->awakew += awake ? p->weight : -p->weight;
+}
 
-    // SET STRIDE
-    for(i = 0; i < num_stride; i++) {
-      stride_list[i].stride = LCM / stride_list[i].proc->share;
-      //cprintf("[%d]: %d ", stride_list[i].proc->share, stride_list[i].stride);
+// Make p a stride client, taking it off the MLFQ run queues.
+// The ptable lock must be held.
+static void
+stridejoin(struct proc *p)
+{
+  int queued = p->rqlev >= 0 && dequeue(p);
+
+  p->sc.pass = ptable.gpass;
+  p->sc.hidx = -1;
+  p->sc.proc = p;
+  p->mlfqlev = -1;
+  p->is_stride = 1;
+  if(p->state != SLEEPING && p->state != ZOMBIE)
+    strideawake(p, 1);
+  if(queued)
+    enqueue(p);
+}
+
+// Set the weight by which the member pid of the calling
+// process's group (a thread, or the process itself) takes
+// part of the process's stride share.
+int
+set_thread_weight(int pid, int weight)
+{
+  struct proc *g = leader(myproc());
+  struct proc *p;
+
+  if(weight < 1 || weight > 100)
+    return -1;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->pid == pid && ingroup(p, g) && p->state != ZOMBIE){
+      if(p->state != SLEEPING)
+	strideawake(p, 0);
+      p->weight = weight;
+      if(p->state != SLEEPING)
+	strideawake(p, 1);
+      release(&ptable.lock);
+      return 0;
     }
-    //cprintf("\n");
   }
+  release(&ptable.lock);
+  return -1;
+}
 
-  // Put all MLFQ in one Stride process;
-  stride_list[num_stride].proc = 0;
-  stride_list[num_stride].pass = 0;
-  stride_list[num_stride].stride = LCM / (100 - total_share); // Sharesize of "one Stride process"
+// Reserve share percent of the CPU for the current process.
+// Returns -1 if the share cannot be granted.
+int
+set_cpu_share(int share)
+{
+  struct proc *p = myproc();
+  struct proc *q;
+  int old;
 
+  if(share <= 0 || p->is_thread == 1)
+    return -1;
 
-} 
+  acquire(&ptable.lock);
+  old = p->is_stride ? p->share : 0;
+  if(total_share - old + share > 80) {
+    release(&ptable.lock);
+    return -1;
+  }
+  if(!p->is_stride) {
+    num_stride++;
+    p->awakew = 0;
+    for(q = ptable.proc; q < &ptable.proc[NPROC]; q++)
+      if(ingroup(q, p) && q->state != ZOMBIE)
+	stridejoin(q);
+  }
+  total_share += share - old;
+  mlfqshare();
+
+  p->share = share;
+  release(&ptable.lock);
+  return 0;
+}
 
 // Must be called with interrupts disabled to avoid the caller being
 // rescheduled between reading lapicid and running through the loop.
@@ -228,15 +619,25 @@ found:
   p->context->eip = (uint)forkret;
 
   p->mlfqlev = 2;
-  p->allotment = 20 * TICKSIZE; // Also allotment for highest priority
+  p->allotment = 20 * tickns; // Also allotment for highest priority
+  p->utime = p->stime = p->runtime = 0;
+  p->epoch = boostepoch;
+  p->rqlev = RQ_NONE;
+  p->rqcpu = -1;
+  p->rqnext = p->rqprev = 0;
   
   p->is_stride   = 0; // Cannot be stride process if newly forked
   p->share       = 0;
+  p->weight      = 1;
+  p->awakew      = 0;
 
   p->is_thread = 0;
   p->num_thread = 0;
   p->num_sleeping_thread = 0;
   p->tgid = 0;
+  p->nstkfree = 0;
+  p->xpgdir = 0;
+  p->gang = 0;
   
   return p;
 }
@@ -266,7 +667,7 @@ userinit(void)
   p->tf->eip = 0;  // beginning of initcode.S
 
   safestrcpy(p->name, "initcode", sizeof(p->name));
-  p->cwd = namei("/");
+  p->fdt = fdtalloc(namei("/"));
 
   // this assignment to p->state lets other cores
   // run this process. the acquire forces the above
@@ -276,27 +677,54 @@ userinit(void)
 
   p->state = RUNNABLE;
   p->mlfqlev = 2;
+  enqueue(p);
 
   release(&ptable.lock);
 }
 
+// Set the size of g's address space in g and all its
+// threads, so every cpu running one of them sees it.
+// The ptable lock must be held.
+static void
+setsz(struct proc *g, uint sz)
+{
+  struct proc *p;
+
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(ingroup(p, g))
+      p->sz = sz;
+}
+
 // Grow current process's memory by n bytes.
 // Return 0 on success, -1 on failure.
+// Threads share the pgdir, and may grow it from several cpus
+// at once, so this is done under the process's vmlock.
+// No TLB shootdown: a sibling on another cpu may briefly
+// keep a stale mapping of memory given back by a shrink.
 int
 growproc(int n)
 {
   uint sz;
   struct proc *curproc = myproc();
+  struct proc *g = leader(curproc);
 
-  sz = curproc->sz;
+  acquiresleep(VMLOCK(g));
+  sz = g->sz;
   if(n > 0){
-    if((sz = allocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if((sz = allocuvm(g->pgdir, sz, sz + n)) == 0){
+      releasesleep(VMLOCK(g));
       return -1;
+    }
   } else if(n < 0){
-    if((sz = deallocuvm(curproc->pgdir, sz, sz + n)) == 0)
+    if((sz = deallocuvm(g->pgdir, sz, sz + n)) == 0){
+      releasesleep(VMLOCK(g));
       return -1;
+    }
   }
-  curproc->sz = sz;
+  acquire(&ptable.lock);
+  setsz(g, sz);
+  release(&ptable.lock);
+  releasesleep(VMLOCK(g));
   switchuvm(curproc);
   return 0;
 }
@@ -307,17 +735,26 @@ growproc(int n)
 int
 fork(void)
 {
-  int i, pid;
+  int pid;
   struct proc *np;
   struct proc *curproc = myproc();
+  struct proc *g = leader(curproc);
 
   // Allocate process.
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  // Copy process state from proc.
-  if((np->pgdir = copyuvm(curproc->pgdir, curproc->sz)) == 0){
+  // Copy process state from proc. Share the memory copy-on-write,
+  // unless other threads may be running on it: their TLBs would
+  // keep writable entries for the pages turned read-only.
+  acquiresleep(VMLOCK(g));
+  if(g->num_thread > 0)
+    np->pgdir = copyuvm(curproc->pgdir, curproc->sz);
+  else
+    np->pgdir = cowuvm(curproc->pgdir, curproc->sz);
+  releasesleep(VMLOCK(g));
+  if(np->pgdir == 0){
     kfree(np->kstack);
     np->kstack = 0;
     np->state = UNUSED;
@@ -330,10 +767,13 @@ fork(void)
   // Clear %eax so that fork returns 0 in the child.
   np->tf->eax = 0;
 
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+  if((np->fdt = fdtcopy(curproc->fdt)) == 0){
+    freevm(np->pgdir);
+    kfree(np->kstack);
+    np->kstack = 0;
+    np->state = UNUSED;
+    return -1;
+  }
 
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
@@ -342,11 +782,137 @@ fork(void)
   acquire(&ptable.lock);
 
   np->state = RUNNABLE;
+  enqueue(np);
 
   release(&ptable.lock);
   return pid;
 }
 
+// Free an exited thread's slot; its pgdir is the group's.
+// The ptable lock must be held.
+static void
+reapthread(struct proc *p)
+{
+  kfree(p->kstack);
+  p->kstack = 0;
+  p->pid = 0;
+  p->parent = 0;
+  p->name[0] = 0;
+  p->killed = 0;
+  p->is_thread = 0;
+  p->is_stride = 0;
+  p->state = UNUSED;
+}
+
+// Kill g and all its threads: whichever of them exits or is
+// killed takes the whole process down.
+// The ptable lock must be held.
+static void
+killgroup(struct proc *g)
+{
+  struct proc *p;
+
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(ingroup(p, g)){
+      p->killed = 1;
+      if(p->state == SLEEPING)
+        wake(p);
+    }
+  }
+}
+
+// exec() from a thread. The new image replaces the whole
+// process, which keeps its pid: the other threads are killed,
+// and the process takes the image over in execover() on its
+// way back to user space. A process asleep is woken for that,
+// and gives up its wait as if killed (see interrupted()).
+// Returns -1 if another thread's exec is already pending.
+int
+execthread(pde_t *pgdir, uint sz, uint entry, uint sp)
+{
+  struct proc *g = myproc()->parent;
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  if(g->xpgdir){
+    release(&ptable.lock);
+    return -1;
+  }
+  g->xpgdir = pgdir;
+  g->xsz = sz;
+  g->xentry = entry;
+  g->xsp = sp;
+  safestrcpy(g->name, myproc()->name, sizeof(g->name));
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(ingroup(p, g) && p != g)
+      p->killed = 1;
+    if(ingroup(p, g) && p->state == SLEEPING)
+      wake(p);
+  }
+  release(&ptable.lock);
+  return 0;
+}
+
+// Take over the image one of the current process's threads
+// exec'd, if there is one. Called only on the way back to
+// user space, once any system call is done with the old image.
+void
+execover(void)
+{
+  struct proc *curproc = myproc();
+  pde_t *oldpgdir;
+
+  if(curproc->xpgdir == 0)
+    return;
+  killthreads();
+  oldpgdir = curproc->pgdir;
+  curproc->pgdir = curproc->xpgdir;
+  curproc->xpgdir = 0;
+  curproc->sz = curproc->xsz;
+  curproc->tf->eip = curproc->xentry;
+  curproc->tf->esp = curproc->xsp;
+  switchuvm(curproc);
+  freevm(oldpgdir);
+}
+
+// Should the current process give up a wait and head back
+// to user space? Yes if it was killed, or has an image to
+// take over.
+int
+interrupted(void)
+{
+  struct proc *p = myproc();
+
+  return p->killed || p->xpgdir;
+}
+
+// Kill the current process's threads and wait for them
+// to exit. They may be running on other cpus in its pgdir,
+// which exit() and exec() are about to let go of.
+void
+killthreads(void)
+{
+  struct proc *curproc = myproc();
+  struct proc *p;
+
+  acquire(&ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
+    if(p->is_thread == 1 && p->parent == curproc){
+      p->killed = 1;
+      if(p->state == SLEEPING)
+        wake(p);
+    }
+  }
+  while(curproc->num_thread > 0)
+    sleep(curproc, &ptable.lock);
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->is_thread == 1 && p->parent == curproc)
+      reapthread(p);
+  curproc->tgid = 0;
+  curproc->nstkfree = 0;  // They go with the pgdir
+  release(&ptable.lock);
+}
+
 // Exit the current process.  Does not return.
 // An exited process remains in the zombie state
 // until its parent calls wait() to find out it exited.
@@ -355,23 +921,25 @@ exit(void)
 {
   struct proc *curproc = myproc();
   struct proc *p;
-  int fd;
 
   if(curproc == initproc)
     panic("init exiting");
 
-  // Close all open files.
-  for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd]){
-      fileclose(curproc->ofile[fd]);
-      curproc->ofile[fd] = 0;
-    }
+  if(curproc->is_thread == 1){
+    acquire(&ptable.lock);
+    killgroup(curproc->parent);
+    release(&ptable.lock);
+    thread_exit(0);
+  }
+  killthreads();
+  if(curproc->xpgdir){  // Killed before taking it over
+    freevm(curproc->xpgdir);
+    curproc->xpgdir = 0;
   }
 
-  begin_op();
-  iput(curproc->cwd);
-  end_op();
-  curproc->cwd = 0;
+  // Close all open files.
+  fdtclose(curproc->fdt);
+  curproc->fdt = 0;
 
   acquire(&ptable.lock);
 
@@ -407,7 +975,7 @@ wait(void)
     // Scan through table looking for exited children.
     havekids = 0;
     for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-      if(p->parent != curproc)
+      if(p->parent != curproc || p->is_thread == 1)
         continue;
       havekids = 1;
       if(p->state == ZOMBIE){
@@ -421,10 +989,12 @@ wait(void)
         p->name[0] = 0;
         p->killed = 0;
         p->state = UNUSED;
-	if(p->is_stride) {
-	  p->is_stride = 0;
-	  set_stride();
+	if(p->is_stride && p->is_thread != 1) {
+	  num_stride--;
+	  total_share -= p->share;
+	  mlfqshare();
 	}
+	p->is_stride = 0;
 
         release(&ptable.lock);
         return pid;
@@ -432,7 +1002,7 @@ wait(void)
     }
 
     // No point waiting if we don't have any children.
-    if(!havekids || curproc->killed){
+    if(!havekids || interrupted()){
       release(&ptable.lock);
       return -1;
     }
@@ -442,6 +1012,84 @@ wait(void)
   }
 }
 
+// Start a quantum of n ticks for the process about to run
+// on this cpu. CPU 0 counts it down on its periodic tick; the
+// other cpus are tickless and arm a one-shot timer for n ticks.
+static void
+quantum(int n)
+{
+  mycpu()->slice = n;
+  lapicquantum(n);
+}
+
+// Quantum in ticks for an MLFQ proc at its level, or 0 for none.
+static int
+mlfqslice(struct proc *p)
+{
+  if(num_stride > 0)
+    return 5;
+  switch(p->mlfqlev){
+  case 2:
+    return 5;
+  case 1:
+    return 10;
+  case 0:
+    return 20;
+  }
+  return 0;
+}
+
+// Gang scheduling. When a cpu takes a thread of a gang process
+// off the run queues, it hands the group's other queued threads
+// to other cpus, which are interrupted to run them right away:
+// their quanta start together and are as long as p's, so the
+// whole gang is preempted together.
+// A cpu already running a member of the group is left alone,
+// and so is one running a stride process, whose reserved share
+// the gang must not take. A cpu between turns may find a stride
+// client due next: the member waits for its next MLFQ turn.
+// The ptable lock must be held.
+static void
+gangstart(struct cpu *c, struct proc *p)
+{
+  struct proc *g = leader(p);
+  struct proc *q;
+  struct cpu *v = cpus;
+  int n = mlfqslice(p);
+
+  for(q = ptable.proc; q < &ptable.proc[NPROC] && v < cpus+ncpu; q++){
+    if(q == p || !ingroup(q, g) || q->rqlev < 0)
+      continue;
+    for(; v < cpus+ncpu; v++)
+      if(v != c && v->gangnext == 0 &&
+	 !(v->proc && (v->proc->is_stride || ingroup(v->proc, g))))
+	break;
+    if(v == cpus+ncpu)
+      break;
+    if(!dequeue(q))
+      continue;
+    q->rqlev = RQ_ACTIVE;
+    q->rqcpu = v - cpus;
+    v->gangslice = n;
+    v->gangnext = q;
+    v->idle = 0;
+    lapicipi(v->apicid, T_IRQ0 + IRQ_WAKEUP);
+    v++;
+  }
+}
+
+// Turn gang scheduling of the current process's threads on or off.
+int
+set_gang(int on)
+{
+  struct proc *g = leader(myproc());
+
+  acquire(&ptable.lock);
+  g->gang = on != 0;
+  release(&ptable.lock);
+  return 0;
+}
+
 //PAGEBREAK: 42
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
@@ -453,112 +1101,76 @@ wait(void)
 void
 scheduler(void)
 {
-  struct proc *p, *q;
+  struct proc *p;
   struct cpu *c = mycpu();
-  int procrun;
-  int passthru;
-  int stride_index;
-  int stampin, stampout;
-  uint empty_mlfq; // when in stride scheduling, if there is no mlfq's to run
+  struct sclient *sc;
+  int64 procrun;
+  int empty_mlfq = 0; // when in stride scheduling, if there is no mlfq's to run
+  int gang, n;
   //uint active_tgid;
   //uint thread_ticks;
 
-  local_ticks = 5; // ???
+  c->slice = 0;
   c->proc = 0;
 
-  // Scheduler booting
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-    if(p->state == RUNNING || p->state == RUNNABLE) {
-      p->mlfqlev = 2;
-      //p->allotment = 50000000; FOR MLFQ + STRIDe
-      p->allotment = 20 * TICKSIZE;
-    }
-    else {
-      p->mlfqlev = -2; // -1 for stride
-      p->allotment = 0; // 0 time for nonexisting process
-    }
-
-    p->is_stride = 0;
-    p->share = 0;
-  }
-
-  // No one except GOD can set Stride process
-  // before even the scheduler has run
-  num_stride = 0;
-  set_stride();
-  
   for(;;){
     // Enable interrupts on this processor.
     // IF pass through gets heavy, move this
     sti();
 
-    // Loop over process table looking for process to run.
-    acquire(&ptable.lock);
+    // Nothing to run anywhere: halt until an interrupt or
+    // a wakeup IPI from enqueue(), leaving ptable.lock alone
+    if(num_stride == 0 && !anyready() && !c->gangnext) {
+      // Zero a page for kalloc_zeroed() first, if it wants one
+      if(kzerofill())
+	continue;
+      cli();
+      c->idle = 1;
+      __sync_synchronize();
+      if(num_stride == 0 && !anyready() && !c->gangnext)
+	stihlt();
+      c->idle = 0;
+      continue;
+    }
 
-    // passes through number of stride lists
-    passthru = stride_list[0].pass;
-    stride_index = 0;
-    if(num_stride > 0) {
-      for(int i = 0; i <= num_stride; i++) {
-        if(stride_list[i].pass <= passthru) {
-	  passthru = stride_list[i].pass;
-	  stride_index = i;
-        }
-      }
+    // With no stride clients every turn is MLFQ's: pick the work
+    // under the run queue locks alone, so cpus only meet on
+    // ptable.lock for the switch itself.
+    p = 0;
+    gang = 0;
+    if(num_stride == 0 && !c->gangnext && (p = pickmlfq(c)) == 0)
+      p = steal(c);
 
-      if(passthru > 0) {
-	if(passthru == stride_list[0].pass) {
-	  for(int i = 0; i <= num_stride; i++)
-	    stride_list[i].pass = 0;
-	}
-      }
-    }
+    acquire(&ptable.lock);
 
+    // The client with the smallest pass runs next
+    sc = ptable.sheap[0];
+    ptable.gpass = sc->pass;
 
+    if(p || sc == &ptable.mlfq) { // MLFQ's turn
+      // Charge the turn up front; other cpus may take MLFQ turns meanwhile
+      if(sc == &ptable.mlfq) {
+	sc->pass += sc->stride;
+	siftdown(0);
+      }
 
-    if(stride_index == num_stride) { // Last one is MLFQ SET
       // MLFQ PART
-      if(num_stride > 0) 
-        empty_mlfq = ticks;
-      
-      // the loop
-      for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
-        
-	// inside
-	if(p->state != RUNNABLE) {
-	  if(p == &ptable.proc[NPROC]){
-	    if(num_stride > 0)
-	      while(ticks == empty_mlfq);
-	  }
-          if(p->num_thread <= 0)
-	    continue;
-	}
-
-	if(p->is_thread == 1)
-	  continue;
+      // A gang member another cpu picked for this one comes first
+      if(p == 0 && (p = c->gangnext) != 0) {
+	c->gangnext = 0;
+	gang = 1;
+      } else if(p || (p = pickmlfq(c)) != 0 || (p = steal(c)) != 0) {
+	if(leader(p)->gang)
+	  gangstart(c, p);
+      }
 
-        if(p->mlfqlev != maxlev())
-	  continue;
+      if(p) {
 
-	if(num_stride == 0) {
-	  switch(p->mlfqlev) {
-	    case 2:
-	      local_ticks = 5;
-	      break;
-	    case 1:
-	      local_ticks = 10;
-	      break;
-	    case 0:
-	      local_ticks = 20;
-	      break;
-	    default:
-	      break;
-	  }
-	} else {
-	  local_ticks = 5;
-	}
+	// Gang members all run for the quantum of the first
+	if((n = gang ? c->gangslice : mlfqslice(p)) > 0)
+	  quantum(n);
         
-	stampin = stamp();
+	c->tscin = rdtsc();
 
         // Switch to chosen process.  It is the process's job
         // to release ptable.lock and then reacquire it
@@ -566,94 +1178,134 @@ scheduler(void)
         c->proc = p;
 	
 	switchuvm(p);
-	
-	// multithreading scheduler ///////
-	///////////////////////////////////
-	if(p->num_thread > 0) {
-	  multithreading = 0;
-	  for(;;) {
-	    for(q = ptable.proc; q < &ptable.proc[NPROC]; q++) {
-	      if(p->num_thread == p->num_sleeping_thread) {
-		goto opt_out;
-	      }
-	      if(multithreading == 0) {
-		q = p->prev_thread + 1; // set first
-		multithreading = 1;
-	      }
-	      if((q->state != RUNNABLE) || (q >= &ptable.proc[NPROC]) || (q->tgid != p->tgid))
-		continue;
-	      c->proc = q;
-	      switchuvm_t(q);
-	      q->state = RUNNING;
-	      swtch(&(c->scheduler), q->context);
-	      if(multithreading == 0)
-		goto opt_out;
-	    }
-	  }
-opt_out:
-	  p->prev_thread = q;
-	  multithreading = 0;
-	} else {
-	  p->state = RUNNING;
-	  swtch(&(c->scheduler), p->context);
-	}
-	///////////////////////////////////
+	p->state = RUNNING;
+	c->tsc = rdtsc();
+	swtch(&(c->scheduler), p->context);
+	p = c->proc; // p may have handed off to a sibling thread
 
 	switchkvm();
+	lapicquantum(0);
 
-        stampout = stamp();
-        procrun = (stampout - stampin)/2;
-	
-	if(p->mlfqlev != 0) p->allotment -= procrun; // No need to deal with allotment in level 0
-	if(p->allotment < 0 && p->mlfqlev == 2) {
-	  p->mlfqlev = 1;
-	  //p->allotment = 100000000; FOR MLFQ + STRIDE
-	  p->allotment = 40 * TICKSIZE;
-        }
-        if(p->allotment < 0 && p->mlfqlev == 1) {
-	  p->mlfqlev = 0;
-	  p->allotment = 0; // An Infinity
-        }
+        procrun = tsc2ns(rdtsc() - c->tscin);
+	p->runtime += procrun;
+	mlfqcharge(p, procrun);
 
         // ULTIMATE DEBUGGER
-        // cprintf("[IN =%d OUT =%d, ELAPSED = %d, LEFT = %d, LEVEL = %d]\n", p->stampin, p->stampout, procrun, p->allotment, p->mlfqlev);
+        // cprintf("[ELAPSED = %d, LEFT = %d, LEVEL = %d]\n", (int)procrun, (int)p->allotment, p->mlfqlev);
 
         // Process is done running for now.
         // It should have changed its p->state before coming back.
         c->proc = 0;
 
-        // NEW STRIDE PROCESS
-        // NOT THAT BEAUTIFUL
-        // COULD POSSIBLY RESULT ERROR
-        if(p->is_stride) break;
-
-      } // ptable for loop
+	// Back to the tail of its (possibly demoted) level
+	// if it is still ready; sleepers are queued by wakeup.
+	p->rqlev = RQ_NONE;
+	enqueue(p);
+      } else if(num_stride > 0) {
+	empty_mlfq = 1;
+      }
 
     } else { // Stride process begins
       // procrun = 50000000; // Stride is for 1 tick by default
       // procrun = 10000000; FOR MLFQ + STRIDE
       // lapic[0x0380/4] = procrun;
-      if(local_ticks <= 0) local_ticks = 5;
-      p = stride_list[stride_index].proc;
-
-      // don't use continue here
-      if(p->state == RUNNABLE) {
-        c->proc = p;
-	switchuvm(p);
-	p->state = RUNNING;
-	swtch(&(c->scheduler), p->context);
-	switchkvm();
-	c->proc = 0;
-      }
+      quantum(5);
+      p = sc->proc;
+      dequeue(p);
+      p->rqlev = RQ_ACTIVE;
+
+      c->proc = p;
+      switchuvm(p);
+      p->state = RUNNING;
+      c->tscin = rdtsc();
+      c->tsc = c->tscin;
+      swtch(&(c->scheduler), p->context);
+      switchkvm();
+      lapicquantum(0);
+      p->runtime += tsc2ns(rdtsc() - c->tscin);
+      c->proc = 0;
+
+      sc->pass += procstride(p);
+      p->rqlev = RQ_NONE;
+      enqueue(p);
     }
 
     __sync_synchronize();
 
-    if(num_stride > 0) stride_list[stride_index].pass += stride_list[stride_index].stride;
     release(&ptable.lock);
+
+    // Nothing in MLFQ to spend its share on: halt for a tick,
+    // zeroing pages for kalloc_zeroed() first if it wants some
+    if(empty_mlfq) {
+      empty_mlfq = 0;
+      cli();
+      quantum(1);
+      while(c->slice > 0) {
+	sti();
+	if(kzerofill()) {
+	  cli();
+	  continue;
+	}
+	cli();
+	if(c->slice > 0)
+	  stihlt();
+	cli();
+      }
+    }
   }
 }
 
+// Direct handoff between threads. When a thread of an MLFQ
+// process gives up the cpu with quantum left and a sibling
+// sharing its pgdir waits at the top level of this cpu's run
+// queues, switch straight to the sibling: only the kernel
+// stack in the TSS changes and the scheduler is not entered.
+// The sibling runs out the rest of the quantum.
+// Returns the sibling, now this cpu's proc, or 0.
+// The ptable lock must be held.
+static struct proc*
+handoff(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  struct proc *q;
+  uint64 now;
+  int64 ns;
+  int lev;
+
+  if(c->slice <= 0 || p->is_stride)
+    return 0;
+  if(p->is_thread != 1 && p->num_thread == 0)
+    return 0;
+  acquire(RQLOCK(c));
+  cpusync(c);
+  for(lev = 2; lev > 0; lev--)
+    if(c->mlfq[lev].head)
+      break;
+  for(q = c->mlfq[lev].head; q; q = q->rqnext)
+    if(q->pgdir == p->pgdir)
+      break;
+  if(q == 0){
+    release(RQLOCK(c));
+    return 0;
+  }
+  rqremove(c, q, RQ_ACTIVE);
+  release(RQLOCK(c));
+
+  // What scheduler() does when p comes back to it
+  now = rdtsc();
+  ns = tsc2ns(now - c->tscin);
+  p->runtime += ns;
+  mlfqcharge(p, ns);
+  p->rqlev = RQ_NONE;
+  enqueue(p);
+
+  c->tscin = now;
+  c->proc = q;
+  switchuvm_t(q);
+  q->state = RUNNING;
+  return q;
+}
+
 // Enter scheduler.  Must hold only ptable.lock
 // and have changed proc->state. Saves and restores
 // intena because intena is a property of this
@@ -666,6 +1318,7 @@ sched(void)
 {
   int intena;
   struct proc *p = myproc();
+  struct proc *q;
 
   if(!holding(&ptable.lock))
     panic("sched ptable.lock");
@@ -675,15 +1328,40 @@ sched(void)
     panic("sched running");
   if(readeflags()&FL_IF)
     panic("sched interruptible");
+  chargetime(0);
   intena = mycpu()->intena;
-  //if(p->num_thread == 0) {
-  //  swtch(&p->context, mycpu()->scheduler);
-  //} else {
-  swtch(&p->context, mycpu()->scheduler);
-  //}
+  if((q = handoff(p)) != 0)
+    swtch(&p->context, q->context);
+  else
+    swtch(&p->context, mycpu()->scheduler);
   mycpu()->intena = intena;
 }
 
+// Charge the current process for the CPU time since this
+// cpu last stamped its TSC: as user time if user is set,
+// otherwise as kernel time.
+void
+chargetime(int user)
+{
+  struct cpu *c;
+  struct proc *p;
+  uint64 now, ns;
+
+  pushcli();
+  c = mycpu();
+  p = c->proc;
+  now = rdtsc();
+  if(p){
+    ns = tsc2ns(now - c->tsc);
+    if(user)
+      p->utime += ns;
+    else
+      p->stime += ns;
+  }
+  c->tsc = now;
+  popcli();
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
@@ -739,7 +1417,15 @@ sleep(void *chan, struct spinlock *lk) {
   }
   // Go to sleep.
   p->chan = chan;
+  strideawake(p, 0);
   p->state = SLEEPING;
+  if(p->is_thread == 1)
+    p->parent->num_sleeping_thread++;
+  p->sprev = 0;
+  p->snext = ptable.sleepq[SLEEPHASH(chan)];
+  if(p->snext)
+    p->snext->sprev = p;
+  ptable.sleepq[SLEEPHASH(chan)] = p;
   sched();
 
   // Tidy up.
@@ -753,20 +1439,39 @@ sleep(void *chan, struct spinlock *lk) {
 }
 
 //PAGEBREAK!
+// Make the sleeping p runnable, taking it off its sleep queue.
+// The ptable lock must be held.
+static void
+wake(struct proc *p)
+{
+  if(p->sprev)
+    p->sprev->snext = p->snext;
+  else
+    ptable.sleepq[SLEEPHASH(p->chan)] = p->snext;
+  if(p->snext)
+    p->snext->sprev = p->sprev;
+  p->snext = p->sprev = 0;
+
+  p->state = RUNNABLE;
+  strideawake(p, 1);
+  if(p->is_thread == 1)
+    p->parent->num_sleeping_thread--;
+  enqueue(p);
+}
+
 // Wake up all processes sleeping on chan.
+// Only chan's sleep queue is searched.
 // The ptable lock must be held.
 static void
 wakeup1(void *chan)
 {
-  struct proc *p;
+  struct proc *p, *next;
 
-  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
-      if(p->is_thread == 1) {
-	p->parent->num_sleeping_thread--;
-      }
-    }
+  for(p = ptable.sleepq[SLEEPHASH(chan)]; p; p = next) {
+    next = p->snext;
+    if(p->chan == chan)
+      wake(p);
+  }
 }
 
 // Wake up all processes sleeping on chan.
@@ -778,6 +1483,173 @@ wakeup(void *chan)
   release(&ptable.lock);
 }
 
+// Timer wheel. A process sleeping for a number of ticks sits
+// in slot deadline % NWHEEL, and each tick only that slot is
+// looked at, so only expired sleepers are woken.
+// The ptable lock must be held.
+static void
+wheeladd(struct proc *p, uint deadline)
+{
+  struct proc **slot = &ptable.wheel[deadline % NWHEEL];
+
+  p->wakeat = deadline;
+  p->tprev = 0;
+  p->tnext = *slot;
+  if(p->tnext)
+    p->tnext->tprev = p;
+  *slot = p;
+  p->ontimer = 1;
+}
+
+static void
+wheeldel(struct proc *p)
+{
+  if(!p->ontimer)
+    return;
+  if(p->tprev)
+    p->tprev->tnext = p->tnext;
+  else
+    ptable.wheel[p->wakeat % NWHEEL] = p->tnext;
+  if(p->tnext)
+    p->tnext->tprev = p->tprev;
+  p->tnext = p->tprev = 0;
+  p->ontimer = 0;
+}
+
+// Called by the timer interrupt each time ticks advances to now.
+void
+wheeltick(uint now)
+{
+  struct proc *p, *next;
+
+  acquire(&ptable.lock);
+  for(p = ptable.wheel[now % NWHEEL]; p; p = next) {
+    next = p->tnext;
+    if((int)(now - p->wakeat) >= 0) {
+      wheeldel(p);
+      wakeup1(&p->wakeat);
+    }
+  }
+  release(&ptable.lock);
+}
+
+// Sleep until ticks reaches deadline.
+// Returns -1 if killed first.
+// The ptable lock must be held.
+static int
+sleepuntil(uint deadline)
+{
+  struct proc *p = myproc();
+
+  while((int)(deadline - ticks) > 0) {
+    if(interrupted())
+      return -1;
+    wheeladd(p, deadline);
+    sleep(&p->wakeat, &ptable.lock);
+    wheeldel(p);
+  }
+  return 0;
+}
+
+// Sleep for n ticks. Returns -1 if killed.
+int
+sleepticks(int n)
+{
+  int r;
+
+  acquire(&ptable.lock);
+  r = sleepuntil(ticks + n);
+  release(&ptable.lock);
+  return r;
+}
+
+// Sleep for at least ns nanoseconds, measured on the TSC.
+// The whole ticks of it are slept on the timer wheel. The first
+// of those is only partly left when the sleep starts, so check
+// the TSC again on waking; less than a tick left is spun away,
+// giving sleeps shorter than a tick their real length.
+// Returns -1 if killed.
+int
+nanosleep(uint ns)
+{
+  uint64 now, deadline = rdtsc() + ns2tsc(ns);
+  uint n;
+
+  while((now = rdtsc()) < deadline){
+    if((n = div64(tsc2ns(deadline - now), tickns)) > 0){
+      if(sleepticks(n) < 0)
+        return -1;
+    } else if(interrupted())
+      return -1;
+  }
+  return 0;
+}
+
+// Futexes. A waiter sleeps on the kernel address of its
+// user word, so all threads of a pgdir meet on one channel.
+// Returns that channel for user address addr, or 0 if addr
+// is not an aligned word of the process.
+// The ptable lock must be held.
+static void*
+futexchan(uint addr)
+{
+  struct proc *p = myproc();
+  char *ka;
+
+  if(addr % sizeof(int) || addr >= p->sz)
+    return 0;
+  if((ka = uva2ka(p->pgdir, (char*)addr)) == 0)
+    return 0;
+  return ka + addr % PGSIZE;
+}
+
+// Sleep until woken by futex_wake(addr), unless the word
+// at addr no longer holds val. The check and the sleep are
+// atomic with respect to futex_wake().
+// Returns -1 if the word changed or on error.
+int
+futex_wait(uint addr, int val)
+{
+  int *w;
+
+  acquire(&ptable.lock);
+  if((w = futexchan(addr)) == 0 || *w != val || interrupted()){
+    release(&ptable.lock);
+    return -1;
+  }
+  sleep(w, &ptable.lock);
+  release(&ptable.lock);
+  return 0;
+}
+
+// Wake up to n waiters on addr, longest waiting first.
+// Returns the number woken.
+int
+futex_wake(uint addr, int n)
+{
+  struct proc *p, *prev;
+  void *chan;
+  int woken = 0;
+
+  acquire(&ptable.lock);
+  if((chan = futexchan(addr)) == 0){
+    release(&ptable.lock);
+    return -1;
+  }
+  // Sleepers are pushed at the head of their bucket
+  for(p = ptable.sleepq[SLEEPHASH(chan)]; p && p->snext; p = p->snext)
+    ;
+  for(; p && woken < n; p = prev){
+    prev = p->sprev;
+    if(p->chan == chan){
+      wake(p);
+      woken++;
+    }
+  }
+  release(&ptable.lock);
+  return woken;
+}
+
 // Kill the process with the given pid.
 // Process won't exit until it returns
 // to user space (see trap in trap.c).
@@ -790,14 +1662,14 @@ kill(int pid)
   acquire(&ptable.lock);
   for(p = ptable.proc; p < &ptable.proc[NPROC]; p++){
     if(p->pid == pid){
-      p->killed = 1;
+      // Killing a thread kills its process
+      if(p->is_thread == 1)
+        p = p->parent;
+      killgroup(p);
       //if(p->is_stride) {
       //  p->is_stride = 0;
       //  set_stride();
       //}
-      // Wake process from sleep if necessary.
-      if(p->state == SLEEPING)
-        p->state = RUNNABLE;
       release(&ptable.lock);
       return 0;
     }
@@ -806,138 +1678,195 @@ kill(int pid)
   return -1;
 }
 
+// Thread stacks. Each is two pages at base: a guard page
+// under the stack page. A joined thread's stack goes on its
+// process's free list for the next thread_create(), so the
+// address space stops growing once the process has reached
+// its peak number of threads. Free stacks keep their pages:
+// they lie below p->sz, where system calls take user pointers
+// to be mapped.
+// The free list is under the ptable lock, which joiners hold.
+
+// Returns the base of a stack for a new thread of g, or 0.
+// g's vmlock must be held.
+static uint
+stackalloc(struct proc *g)
+{
+  uint base, sz;
+
+  acquire(&ptable.lock);
+  base = g->nstkfree > 0 ? g->stkfree[--g->nstkfree] : 0;
+  release(&ptable.lock);
+  if(base == 0){
+    base = PGROUNDUP(g->sz);
+    if((sz = allocuvm(g->pgdir, g->sz, base + 2*PGSIZE)) == 0)
+      return 0;
+    acquire(&ptable.lock);
+    setsz(g, sz);
+    release(&ptable.lock);
+  }
+  clearpteu(g->pgdir, (char*)base);
+  return base;
+}
+
+// The ptable lock must be held.
+static void
+stackfree(struct proc *g, uint base)
+{
+  g->stkfree[g->nstkfree++] = base;
+}
+
 int
 thread_create(thread_t *thread, void *(*start_routine)(void *), void *arg)
 {
-  int i;
-  uint sz, sp;
+  uint base, sp;
   uint ustack[2];
   pde_t *pgdir;
   struct proc *np;
   struct proc *curproc = myproc();
+  struct proc *g = leader(curproc);
   
   if((np = allocproc()) == 0){
     return -1;
   }
 
-  acquire(&ptable.lock);
-
-  // for mess cleanup
-  if(curproc->num_thread == 0) {
-    curproc->prev_thread = np;
-    curproc->old_sz = curproc->sz;
-    curproc->tgid = next_tgid;
-    next_tgid++;
-  }
-
-  sz = curproc->sz;
-  pgdir = curproc->pgdir;
+  // Set up the stack under the vmlock alone: copying pages
+  // out of copy-on-write, or growing the address space for
+  // the stack, can take a while
+  acquiresleep(VMLOCK(g));
+  // The threads will share the page table: no copy-on-write
+  if(g->num_thread == 0 && cowbreak(g->pgdir, g->sz) < 0)
+    goto bad;
 
-  if((sz = allocuvm(pgdir, sz, sz + 2 * PGSIZE)) == 0) return -1;
-  clearpteu(pgdir, (char*)(sz - 2*PGSIZE));
+  pgdir = g->pgdir;
+  if((base = stackalloc(g)) == 0)
+    goto bad;
 
-  sp = sz;
+  sp = base + 2*PGSIZE;
   sp -= 2*sizeof(uint);
   ustack[0] = 0xffffffff;
   ustack[1] = (uint)arg;
-  if(copyout(pgdir, sp, ustack, 2*sizeof(uint))) return -1;
-  
-  curproc->pgdir = pgdir;
-  curproc->sz = sz;
-  
+  if(copyout(pgdir, sp, ustack, 2*sizeof(uint)) < 0)
+    goto badstack;
+
+  acquire(&ptable.lock);
+  // The group is being torn down by exit, exec or kill, which
+  // waits for num_thread to drop to zero: add no more threads
+  if(g->killed || curproc->killed){
+    release(&ptable.lock);
+    goto badstack;
+  }
+
+  if(g->num_thread == 0) {
+    g->tgid = next_tgid;
+    next_tgid++;
+  }
+
   // ADDRESS SPACE SHARING //
-  np->pgdir = curproc->pgdir;
+  np->pgdir = pgdir;
   ///////////////////////////
 
-  np->sz = curproc->sz;
-  np->parent = curproc;
+  np->parent = g;
+  np->is_thread = 1;
+  np->ustack = base;
+  np->sz = g->sz;
   *np->tf = *curproc->tf;
 
   np->tf->eip = (uint)start_routine;
   np->tf->esp = sp;
   np->tf->eax = 0;
 
-  // if there isn't this procedure, thread cannot printf
-  for(i = 0; i < NOFILE; i++)
-    if(curproc->ofile[i])
-      np->ofile[i] = filedup(curproc->ofile[i]);
-  np->cwd = idup(curproc->cwd);
+  // Threads share the process's open files
+  np->fdt = fdtdup(curproc->fdt);
   safestrcpy(np->name, curproc->name, sizeof(curproc->name));
 
-  np->state = RUNNABLE;
-  
-  np->is_thread = 1;
-  np->is_stride = curproc->is_stride;
-  np->mlfqlev = -1;
-  
-  np->tgid = curproc->tgid; // put into same thread group
+  np->tgid = g->tgid; // put into same thread group
   *thread = np->pid;
-  curproc->num_thread++;
+  g->num_thread++;
 
-  //cprintf("created %d\n", curproc->num_thread);
+  np->state = RUNNABLE;
+  if(g->is_stride) {
+    stridejoin(np);
+  }
+  enqueue(np);
+
+  //cprintf("created %d\n", g->num_thread);
   release(&ptable.lock);
+  releasesleep(VMLOCK(g));
 
   return 0;
+
+badstack:
+  acquire(&ptable.lock);
+  stackfree(g, base);
+  release(&ptable.lock);
+bad:
+  releasesleep(VMLOCK(g));
+  kfree(np->kstack);
+  np->kstack = 0;
+  np->state = UNUSED;
+  return -1;
 }
 
 void
 thread_exit(void *retval)
 {
-  acquire(&ptable.lock);
   struct proc *curproc = myproc();
+  struct proc *g = curproc->parent;
+
   if(curproc->is_thread != 1) panic("non-thread thread_exiting");
-  
+
+  fdtclose(curproc->fdt);
+  curproc->fdt = 0;
+
+  acquire(&ptable.lock);
   curproc->retval = retval;
+  strideawake(curproc, 0);
   curproc->state = ZOMBIE;
-  curproc->parent->state = RUNNABLE;
-  curproc->parent->num_thread--;
-  
-  if(!holding(&ptable.lock))
-    panic("sched ptable.lock");
-  if(mycpu()->ncli != 1)
-    panic("sched locks");
-  if(readeflags()&FL_IF)
-    panic("sched interruptible");
-  swtch(&curproc->context, mycpu()->scheduler);
+  g->num_thread--;
+
+  // Joiners sleep on the thread, an exiting leader on itself
+  wakeup1(curproc);
+  wakeup1(g);
+
+  sched();
   panic("THIS SHOULDN'T");
 }
 
+// Wait for a thread of this process to exit.
+// Any thread of the process may join any other.
 int
 thread_join(thread_t thread, void **retval)
 {
-  int sz;
   struct proc *p;
-  struct proc *curproc = myproc();
+  struct proc *g = leader(myproc());
   
   acquire(&ptable.lock);
-  for(;;){
-    //cprintf("<sleeping for %d>\n", thread);
-    for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
-      if(p->pid == thread)
-	break;
-    if(p->state == ZOMBIE) {
-      //cprintf("thread termination confirmed\n");
-      *retval = p->retval;
-      kfree(p->kstack);
-      p->kstack = 0;
-      p->pid = 0;
-      p->parent = 0;
-      p->name[0] = 0;
-      p->killed = 0;
-      p->state = UNUSED;
-      if(curproc->num_thread == 0) {
-	//cprintf("no more threads left\n");
-	if((sz = deallocuvm(curproc->pgdir, curproc->sz, curproc->old_sz)) == 0)
-	  return -1;
-	curproc->sz = sz;
-	curproc->tgid = 0;
-	multithreading = 0;
-      }
+  for(p = ptable.proc; p < &ptable.proc[NPROC]; p++)
+    if(p->pid == thread && p->is_thread == 1 && p->parent == g)
+      break;
+  if(p == &ptable.proc[NPROC] || p == myproc()){
+    release(&ptable.lock);
+    return -1;
+  }
+  while(p->state != ZOMBIE){
+    sleep(p, &ptable.lock);
+    if(p->pid != thread){  // Another joiner got it first
       release(&ptable.lock);
-      return 0;
+      return -1;
     }
-    sleep(myproc(), &ptable.lock);
   }
+
+  //cprintf("thread termination confirmed\n");
+  *retval = p->retval;
+  stackfree(g, p->ustack);
+  reapthread(p);
+  if(g->num_thread == 0) {
+    //cprintf("no more threads left\n");
+    g->tgid = 0;
+  }
+  release(&ptable.lock);
+  return 0;
 }
 
 //PAGEBREAK: 36
@@ -967,7 +1896,9 @@ procdump(void)
       state = states[p->state];
     else
       state = "???";
-    cprintf("%d %s %s", p->pid, state, p->name);
+    cprintf("%d %s %s %dms (user %dms, sys %dms)", p->pid, state, p->name,
+            (int)div64(p->runtime, 1000000), (int)div64(p->utime, 1000000),
+            (int)div64(p->stime, 1000000));
     if(p->state == SLEEPING){
       getcallerpcs((uint*)p->context->ebp+2, pc);
       for(i=0; i<10 && pc[i] != 0; i++)
@@ -1,3 +1,22 @@
+// MLFQ run queue, linked through proc.rqnext / proc.rqprev
+struct runq {
+  struct proc *head;
+  struct proc *tail;
+};
+
+#define RQ_NONE   -1   // proc.rqlev: not on any run queue
+#define RQ_ACTIVE -2   // proc.rqlev: taken off the queue by a scheduler
+#define RQ_STRIDE -3   // proc.rqlev: on the stride heap
+
+// Stride scheduling client
+#define STRIDE1 (1 << 20)      // stride = STRIDE1 / share
+struct sclient {
+  uint64 pass;                 // Virtual time of the next slice
+  uint stride;                 // STRIDE1 / share; procs use procstride()
+  int hidx;                    // Index in the stride heap, -1 if not on it
+  struct proc *proc;           // Owner, 0 for the MLFQ client
+};
+
 // Per-CPU state
 struct cpu {
   uchar apicid;                // Local APIC ID
@@ -8,6 +27,15 @@ struct cpu {
   int ncli;                    // Depth of pushcli nesting.
   int intena;                  // Were interrupts enabled before pushcli?
   struct proc *proc;           // The process running on this cpu or null
+  struct runq mlfq[3];         // MLFQ run queues, one per level
+  volatile int nready;         // Number of procs on this cpu's run queues
+  int slice;                   // Ticks left in the running proc's quantum
+  uint64 tsc;                  // TSC when the running proc's time was last charged
+  uint64 tscin;                // TSC when the running proc was switched in
+  uint epoch;                  // Boost epoch the run queues belong to
+  volatile int idle;           // Halted in scheduler(), waiting for work
+  struct proc *volatile gangnext; // Gang member handed over by another cpu
+  int gangslice;               // Ticks gangnext runs for
 };
 
 extern struct cpu cpus[NCPU];
@@ -45,27 +73,49 @@ struct proc {
   struct trapframe *tf;        // Trap frame for current syscall
   struct context *context;     // swtch() here to run process
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *snext;          // Sleep queue links
+  struct proc *sprev;
+  uint wakeat;                 // Deadline tick on the timer wheel
+  int ontimer;                 // On the timer wheel
+  struct proc *tnext;          // Timer wheel links
+  struct proc *tprev;
   int killed;                  // If non-zero, have been killed
-  struct file *ofile[NOFILE];  // Open files
-  struct inode *cwd;           // Current directory
+  struct fdtable *fdt;         // Open files and current directory
   char name[16];               // Process name (debugging)
+  uint64 utime;                // ns spent in user mode
+  uint64 stime;                // ns spent in the kernel
+  uint64 runtime;              // ns dispatched by the scheduler
 
   // MLFQ
   int mlfqlev;			// MLFQ level of the current process
-  int allotment;		// allotment
+  int64 allotment;		// ns left at this level before demotion
+  uint epoch;			// Boost epoch mlfqlev and allotment belong to
+  int rqlev;			// Run queue holding this proc, or RQ_NONE/RQ_ACTIVE
+  int rqcpu;			// CPU whose run queues hold (or last held) this proc
+  struct proc *rqnext;		// Run queue links
+  struct proc *rqprev;
 
   // Stride
   int is_stride;		// Identifier
   int share;			// Share
+  struct sclient sc;		// Stride client, valid if is_stride
+  int weight;			// Part of the process's share a member takes
+  int awakew;			// Weight of the group's awake members
 
   // Thread support
   int is_thread;
   int num_thread;
   int num_sleeping_thread;
   void *retval;
-  int old_sz;
+  uint ustack;                  // Base of a thread's user stack
+  uint stkfree[NPROC];          // Stacks of joined threads, for reuse
+  int nstkfree;
   uint tgid; // thread group id, 0 if non thread related
-  struct proc *prev_thread;
+  int gang;                     // Gang-schedule the threads (on the process)
+  pde_t *xpgdir;                // Image a thread exec'd, for the process
+  uint xsz;                     //   to take over in exit()
+  uint xentry;
+  uint xsp;
 };
 
 // Process memory is laid out contiguously, low addresses first:
@@ -0,0 +1,186 @@
+// Slab allocator for small kernel objects: pipes, open files,
+// descriptor tables and in-memory inodes.
+// A cache hands out objects of one size, carved out of pages
+// from kalloc(). Each page (a slab) starts with a header that
+// keeps the list of its free objects, so kmem_cache_free() finds
+// it by rounding the object's address down.
+// As with kalloc(), each cpu keeps a magazine of up to NSLABMAG
+// free objects per cache that only it touches, with interrupts
+// off, and exchanges half a magazine at a time with the slabs.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "mmu.h"
+#include "spinlock.h"
+
+struct obj {
+  struct obj *next;
+};
+
+// At the start of each slab page.
+struct slab {
+  struct kmem_cache *cache;
+  struct slab *next;    // On the cache's partial list
+  struct slab *prev;
+  struct obj *freelist;
+  uint nfree;
+};
+
+struct kmem_cache {
+  char *name;
+  uint size;
+  uint perslab;         // Objects in a slab
+  struct spinlock lock; // Protects the slabs
+  struct slab partial;  // Slabs with free objects
+  struct omag {
+    void *obj[NSLABMAG];
+    int n;
+  } __attribute__((aligned(64))) mag[NCPU];
+};
+
+struct {
+  int n;
+  struct kmem_cache cache[NSLABCACHE];
+} slabs;
+
+// Create a cache of objects of size bytes.
+// Called only while booting, on the first cpu.
+struct kmem_cache*
+kmem_cache_create(char *name, uint size)
+{
+  struct kmem_cache *c;
+
+  size = (size + 7) & ~7;
+  if(size > PGSIZE - sizeof(struct slab))
+    panic("kmem_cache_create: size");
+
+  if(slabs.n == NSLABCACHE)
+    panic("kmem_cache_create: no caches");
+  c = &slabs.cache[slabs.n++];
+
+  c->name = name;
+  c->size = size;
+  c->perslab = (PGSIZE - sizeof(struct slab)) / size;
+  initlock(&c->lock, name);
+  c->partial.next = c->partial.prev = &c->partial;
+  return c;
+}
+
+// Carve a new page into objects.
+// The cache's lock must be held.
+static struct slab*
+slabgrow(struct kmem_cache *c)
+{
+  struct slab *s;
+  struct obj *o;
+  char *v;
+  uint i;
+
+  if((v = kalloc()) == 0)
+    return 0;
+  s = (struct slab*)v;
+  s->cache = c;
+  s->freelist = 0;
+  for(i = c->perslab; i > 0; i--){
+    o = (struct obj*)(v + sizeof(struct slab) + (i-1)*c->size);
+    o->next = s->freelist;
+    s->freelist = o;
+  }
+  s->nfree = c->perslab;
+  s->next = c->partial.next;
+  s->prev = &c->partial;
+  c->partial.next->prev = s;
+  c->partial.next = s;
+  return s;
+}
+
+// Fill an empty magazine halfway from the slabs.
+static void
+magrefill(struct kmem_cache *c, struct omag *m)
+{
+  struct slab *s;
+  struct obj *o;
+
+  acquire(&c->lock);
+  while(m->n < NSLABMAG/2){
+    s = c->partial.next;
+    if(s == &c->partial && (s = slabgrow(c)) == 0)
+      break;
+    o = s->freelist;
+    s->freelist = o->next;
+    m->obj[m->n++] = o;
+    if(--s->nfree == 0){  // Full now: off the partial list
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+    }
+  }
+  release(&c->lock);
+}
+
+// Return half of a full magazine to the slabs, giving
+// slabs that become empty back to kalloc(), except the
+// last one on the partial list.
+static void
+magdrain(struct kmem_cache *c, struct omag *m)
+{
+  struct slab *s;
+  struct obj *o;
+  int i;
+
+  acquire(&c->lock);
+  for(i = 0; i < NSLABMAG/2; i++){
+    o = m->obj[--m->n];
+    s = (struct slab*)PGROUNDDOWN((uint)o);
+    o->next = s->freelist;
+    s->freelist = o;
+    if(s->nfree++ == 0){  // Was full: back on the partial list
+      s->next = c->partial.next;
+      s->prev = &c->partial;
+      c->partial.next->prev = s;
+      c->partial.next = s;
+    }
+    if(s->nfree == c->perslab &&
+       (s->next != &c->partial || s->prev != &c->partial)){
+      s->prev->next = s->next;
+      s->next->prev = s->prev;
+      kfree((char*)s);
+    }
+  }
+  release(&c->lock);
+}
+
+// Allocate an object from cache c.
+// Returns 0 if the memory cannot be allocated.
+void*
+kmem_cache_alloc(struct kmem_cache *c)
+{
+  struct omag *m;
+  void *v = 0;
+
+  pushcli();
+  m = &c->mag[cpuid()];
+  if(m->n == 0)
+    magrefill(c, m);
+  if(m->n > 0)
+    v = m->obj[--m->n];
+  popcli();
+  return v;
+}
+
+// Free object v, which came from cache c.
+void
+kmem_cache_free(struct kmem_cache *c, void *v)
+{
+  struct omag *m;
+
+  if(((struct slab*)PGROUNDDOWN((uint)v))->cache != c)
+    panic("kmem_cache_free");
+
+  pushcli();
+  m = &c->mag[cpuid()];
+  m->obj[m->n++] = v;
+  if(m->n == NSLABMAG)
+    magdrain(c, m);
+  popcli();
+}
@@ -119,6 +119,11 @@ extern int sys_thread_join(void);
 extern int sys_thread_exit(void);
 
 extern int sys_print_order(void);
+extern int sys_nanosleep(void);
+extern int sys_futex_wait(void);
+extern int sys_futex_wake(void);
+extern int sys_set_thread_weight(void);
+extern int sys_set_gang(void);
 
 static int (*syscalls[])(void) = {
 [SYS_fork]    sys_fork,
@@ -158,6 +163,11 @@ static int (*syscalls[])(void) = {
 [SYS_thread_exit] sys_thread_exit,
 
 [SYS_print_order] sys_print_order,
+[SYS_nanosleep] sys_nanosleep,
+[SYS_futex_wait] sys_futex_wait,
+[SYS_futex_wake] sys_futex_wake,
+[SYS_set_thread_weight] sys_set_thread_weight,
+[SYS_set_gang] sys_set_gang,
 };
 
 void
@@ -38,3 +38,8 @@
 #define SYS_thread_join 34
 
 #define SYS_print_order 35
+#define SYS_nanosleep 36
+#define SYS_futex_wait 37
+#define SYS_futex_wake 38
+#define SYS_set_thread_weight 39
+#define SYS_set_gang 40
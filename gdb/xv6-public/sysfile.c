@@ -18,20 +18,29 @@
 
 // Fetch the nth word-sized system call argument as a file descriptor
 // and return both the descriptor and the corresponding struct file.
+// The file comes with a reference of its own, since another thread
+// may close fd meanwhile: the caller must fileclose() it.
 static int
 argfd(int n, int *pfd, struct file **pf)
 {
   int fd;
   struct file *f;
+  struct fdtable *t = myproc()->fdt;
 
   if(argint(n, &fd) < 0)
     return -1;
-  if(fd < 0 || fd >= NOFILE || (f=myproc()->ofile[fd]) == 0)
+  if(fd < 0 || fd >= NOFILE)
     return -1;
+  acquire(&t->lock);
+  if((f = t->ofile[fd]) == 0){
+    release(&t->lock);
+    return -1;
+  }
+  filedup(f);
+  release(&t->lock);
   if(pfd)
     *pfd = fd;
-  if(pf)
-    *pf = f;
+  *pf = f;
   return 0;
 }
 
@@ -41,14 +50,17 @@ static int
 fdalloc(struct file *f)
 {
   int fd;
-  struct proc *curproc = myproc();
+  struct fdtable *t = myproc()->fdt;
 
+  acquire(&t->lock);
   for(fd = 0; fd < NOFILE; fd++){
-    if(curproc->ofile[fd] == 0){
-      curproc->ofile[fd] = f;
+    if(t->ofile[fd] == 0){
+      t->ofile[fd] = f;
+      release(&t->lock);
       return fd;
     }
   }
+  release(&t->lock);
   return -1;
 }
 
@@ -60,9 +72,10 @@ sys_dup(void)
 
   if(argfd(0, 0, &f) < 0)
     return -1;
-  if((fd=fdalloc(f)) < 0)
+  if((fd=fdalloc(f)) < 0){
+    fileclose(f);
     return -1;
-  filedup(f);
+  }
   return fd;
 }
 
@@ -70,24 +83,28 @@ int
 sys_read(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return fileread(f, p, n);
+  r = fileread(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 int
 sys_write(void)
 {
   struct file *f;
-  int n;
+  int n, r;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filewrite(f, p, n);
+  r = filewrite(f, p, n);
+  fileclose(f);
+  return r;
 }
 
 // milestone
@@ -95,24 +112,28 @@ int
 sys_pread(void)
 {
   struct file *f;
-  int n, off;
+  int n, off, r;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argint(3, &off) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argint(3, &off) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filepread(f, p, n, off);
+  r = filepread(f, p, n, off);
+  fileclose(f);
+  return r;
 }
 
 int
 sys_pwrite(void)
 {
   struct file *f;
-  int n, off;
+  int n, off, r;
   char *p;
 
-  if(argfd(0, 0, &f) < 0 || argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argint(3, &off) < 0)
+  if(argint(2, &n) < 0 || argptr(1, &p, n) < 0 || argint(3, &off) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filepwrite(f, p, n, off);
+  r = filepwrite(f, p, n, off);
+  fileclose(f);
+  return r;
 }
 
 //
@@ -138,10 +159,18 @@ sys_close(void)
 {
   int fd;
   struct file *f;
+  struct fdtable *t = myproc()->fdt;
 
-  if(argfd(0, &fd, &f) < 0)
+  if(argint(0, &fd) < 0 || fd < 0 || fd >= NOFILE)
     return -1;
-  myproc()->ofile[fd] = 0;
+  // Another thread may be closing fd too
+  acquire(&t->lock);
+  if((f = t->ofile[fd]) == 0){
+    release(&t->lock);
+    return -1;
+  }
+  t->ofile[fd] = 0;
+  release(&t->lock);
   fileclose(f);
   return 0;
 }
@@ -151,10 +180,13 @@ sys_fstat(void)
 {
   struct file *f;
   struct stat *st;
+  int r;
 
-  if(argfd(0, 0, &f) < 0 || argptr(1, (void*)&st, sizeof(*st)) < 0)
+  if(argptr(1, (void*)&st, sizeof(*st)) < 0 || argfd(0, 0, &f) < 0)
     return -1;
-  return filestat(f, st);
+  r = filestat(f, st);
+  fileclose(f);
+  return r;
 }
 
 // Create the path new as a link to the same inode as old.
@@ -415,8 +447,8 @@ int
 sys_chdir(void)
 {
   char *path;
-  struct inode *ip;
-  struct proc *curproc = myproc();
+  struct inode *ip, *old;
+  struct fdtable *t = myproc()->fdt;
   
   begin_op();
   if(argstr(0, &path) < 0 || (ip = namei(path)) == 0){
@@ -430,9 +462,12 @@ sys_chdir(void)
     return -1;
   }
   iunlock(ip);
-  iput(curproc->cwd);
+  acquire(&t->lock);
+  old = t->cwd;
+  t->cwd = ip;
+  release(&t->lock);
+  iput(old);
   end_op();
-  curproc->cwd = ip;
   return 0;
 }
 
@@ -468,6 +503,7 @@ sys_pipe(void)
   int *fd;
   struct file *rf, *wf;
   int fd0, fd1;
+  struct fdtable *t = myproc()->fdt;
 
   if(argptr(0, (void*)&fd, 2*sizeof(fd[0])) < 0)
     return -1;
@@ -475,8 +511,11 @@ sys_pipe(void)
     return -1;
   fd0 = -1;
   if((fd0 = fdalloc(rf)) < 0 || (fd1 = fdalloc(wf)) < 0){
-    if(fd0 >= 0)
-      myproc()->ofile[fd0] = 0;
+    if(fd0 >= 0){
+      acquire(&t->lock);
+      t->ofile[fd0] = 0;
+      release(&t->lock);
+    }
     fileclose(rf);
     fileclose(wf);
     return -1;
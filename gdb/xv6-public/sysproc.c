@@ -66,23 +66,40 @@ int
 sys_sleep(void)
 {
   int n;
-  uint ticks0;
 
   if(argint(0, &n) < 0)
     return -1;
-  acquire(&tickslock);
-  ticks0 = ticks;
-  while(ticks - ticks0 < n){
-    if(myproc()->killed){
-      release(&tickslock);
-      return -1;
-    }
-    if(myproc()->is_thread == 1)
-      myproc()->parent->num_sleeping_thread++;
-    sleep(&ticks, &tickslock);
-  }
-  release(&tickslock);
-  return 0;
+  return sleepticks(n);
+}
+
+int
+sys_nanosleep(void)
+{
+  int ns;
+
+  if(argint(0, &ns) < 0)
+    return -1;
+  return nanosleep(ns);
+}
+
+int
+sys_futex_wait(void)
+{
+  int addr, val;
+
+  if(argint(0, &addr) < 0 || argint(1, &val) < 0)
+    return -1;
+  return futex_wait(addr, val);
+}
+
+int
+sys_futex_wake(void)
+{
+  int addr, n;
+
+  if(argint(0, &addr) < 0 || argint(1, &n) < 0)
+    return -1;
+  return futex_wake(addr, n);
 }
 
 // return how many clock tick interrupts have occurred
@@ -115,7 +132,7 @@ sys_procdump(void)
 int
 sys_getlev(void)
 {
-  return myproc()->mlfqlev;
+  return getlev();
 }
 
 int
@@ -123,26 +140,34 @@ sys_set_cpu_share(void)
 {
   int share;
 
-  cli();
   if(argint(0, &share) < 0)
     return -1;
-  if(share <= 0) return -1;
-  //cprintf("SHARE %d\n", share);
-  if(share + total_share > 80) {
+  if(set_cpu_share(share) < 0)
     return -1;
-  }
-  myproc()->mlfqlev = -1;
-  //myproc()->hitzone = 0;
-  //myproc()->strike = 0;
-  myproc()->is_stride = 1;
-  myproc()->share = share;
-  __sync_synchronize();
-  set_stride();
-  sti();
   yield();
   return 0;
 }
 
+int
+sys_set_thread_weight(void)
+{
+  int pid, weight;
+
+  if(argint(0, &pid) < 0 || argint(1, &weight) < 0)
+    return -1;
+  return set_thread_weight(pid, weight);
+}
+
+int
+sys_set_gang(void)
+{
+  int on;
+
+  if(argint(0, &on) < 0)
+    return -1;
+  return set_gang(on);
+}
+
 int
 sys_thread_join(void)
 {
@@ -0,0 +1,64 @@
+// Run more coroutines than there could ever be procs,
+// some of them sleeping in the kernel through co_call().
+// usage: test_co [coroutines]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NROUND 10
+#define NSLEEPER 8
+
+int count;
+
+void
+counter(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NROUND; i++){
+    count++;
+    co_yield();
+  }
+}
+
+int
+dosleep(void *arg)
+{
+  return sleep((int)arg);
+}
+
+void
+sleeper(void *arg)
+{
+  if(co_call(dosleep, (void*)10) < 0)
+    printf(1, "sleeper: sleep failed\n");
+  count += NROUND;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n = 1000;
+  int t0;
+
+  if(argc >= 2)
+    n = atoi(argv[1]);
+
+  for(i = 0; i < NSLEEPER; i++)
+    if(co_create(sleeper, 0) < 0)
+      goto oom;
+  for(i = 0; i < n; i++)
+    if(co_create(counter, 0) < 0)
+      goto oom;
+
+  t0 = uptime();
+  co_run();
+  printf(1, "%d coroutines, count %d (want %d), %d ticks\n",
+         n + NSLEEPER, count, (n + NSLEEPER) * NROUND, uptime() - t0);
+  exit();
+
+oom:
+  printf(1, "co_create: out of memory\n");
+  exit();
+}
@@ -0,0 +1,63 @@
+// Fork latency for parents of 1MB to 64MB: fork and exit at once,
+// as before an exec, and fork with the child writing all of memory.
+// usage: test_fork [max MB]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define NFORK 10
+#define MB    (1024*1024)
+#define PAGE  4096
+
+char *mem;
+int size;
+
+// Average Kcycles for one fork, child exit and wait.
+uint
+forktime(int touch)
+{
+  uint64 t0, t1;
+  int i, off, pid;
+
+  t0 = rdtsc();
+  for(i = 0; i < NFORK; i++){
+    if((pid = fork()) < 0){
+      printf(1, "fork failed\n");
+      exit();
+    }
+    if(pid == 0){
+      if(touch)
+        for(off = 0; off < size; off += PAGE)
+          mem[off] = 1;
+      exit();
+    }
+    wait();
+  }
+  t1 = rdtsc();
+  return (uint)((t1 - t0) >> 10) / NFORK;
+}
+
+int
+main(int argc, char *argv[])
+{
+  int mb, max = 64, off;
+
+  if(argc >= 2)
+    max = atoi(argv[1]);
+
+  printf(1, "parent MB  fork+exit Kcycles  fork+write Kcycles\n");
+  for(mb = 1; mb <= max; mb *= 2){
+    size = mb * MB;
+    if((mem = sbrk(size)) == (char*)-1){
+      printf(1, "sbrk %d MB failed\n", mb);
+      break;
+    }
+    for(off = 0; off < size; off += PAGE)
+      mem[off] = 1;
+    printf(1, "%d  %d  %d\n", mb, forktime(0), forktime(1));
+    sbrk(-size);
+  }
+  exit();
+}
@@ -0,0 +1,79 @@
+// Barrier-heavy threads beside CPU hogs, with and without
+// gang scheduling.
+// usage: test_gang [threads]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define ROUNDS 2000   // Barrier rounds
+#define WORK   2000   // Steps of work between barriers
+#define NHOG   2      // Competing single-threaded processes
+#define MAXT   8
+
+barrier_t bar;
+int out[MAXT];
+
+void*
+worker(void *arg)
+{
+  int id = (int)arg;
+  uint x = id;
+  int r, k;
+
+  for(r = 0; r < ROUNDS; r++){
+    for(k = 0; k < WORK; k++)
+      x = x * 1103515245 + 12345;
+    barrier_wait(&bar);
+  }
+  out[id] = x;
+  thread_exit(0);
+  return 0;
+}
+
+uint
+run(int n)
+{
+  thread_t t[MAXT];
+  uint64 t0, t1;
+  void *ret;
+  int i;
+
+  barrier_init(&bar, n);
+  t0 = rdtsc();
+  for(i = 0; i < n; i++)
+    thread_create(&t[i], worker, (void*)i);
+  for(i = 0; i < n; i++)
+    thread_join(t[i], &ret);
+  t1 = rdtsc();
+  return (uint)((t1 - t0) >> 10);
+}
+
+int
+main(int argc, char *argv[])
+{
+  int pid[NHOG];
+  int i, n = 2;
+
+  if(argc >= 2)
+    n = atoi(argv[1]);
+  if(n < 1 || n > MAXT)
+    n = 2;
+
+  for(i = 0; i < NHOG; i++){
+    if((pid[i] = fork()) == 0)
+      for(;;)
+        ;
+  }
+
+  printf(1, "%d threads, gang off: %d Kcycles\n", n, run(n));
+  set_gang(1);
+  printf(1, "%d threads, gang on:  %d Kcycles\n", n, run(n));
+
+  for(i = 0; i < NHOG; i++){
+    kill(pid[i]);
+    wait();
+  }
+  exit();
+}
@@ -0,0 +1,54 @@
+// Check that a nanosleep() shorter than a tick returns in less
+// than a tick, rather than at the next tick or later.
+// usage: test_nsleep
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define NTRY 20
+
+// TSC cycles in one tick, timed across two tick edges.
+uint64
+tickcycles(void)
+{
+  uint64 t0;
+  int u;
+
+  u = uptime();
+  while(uptime() == u)
+    ;
+  u = uptime();
+  t0 = rdtsc();
+  while(uptime() == u)
+    ;
+  return rdtsc() - t0;
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64 tick, t0, t, worst;
+  int i;
+
+  tick = tickcycles();
+
+  worst = 0;
+  for(i = 0; i < NTRY; i++){
+    t0 = rdtsc();
+    if(nanosleep(1000) < 0){
+      printf(1, "nanosleep failed\n");
+      exit();
+    }
+    if((t = rdtsc() - t0) > worst)
+      worst = t;
+  }
+  if(worst >= tick)
+    printf(1, "1us sleep: FAILED, took %d of %d Kcycles per tick\n",
+           (uint)(worst >> 10), (uint)(tick >> 10));
+  else
+    printf(1, "1us sleep: ok, at most %d Kcycles, tick %d Kcycles\n",
+           (uint)(worst >> 10), (uint)(tick >> 10));
+  exit();
+}
@@ -0,0 +1,58 @@
+// Benchmark parallel_for speedup with 1 to N workers.
+// usage: test_pool [max workers]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+#include "x86.h"
+
+#define N     4096   // Iterations
+#define WORK  20000  // Steps of work in each
+#define GRAIN 16
+
+int out[N];
+
+void
+body(void *arg, int lo, int hi)
+{
+  uint x;
+  int i, k;
+
+  for(i = lo; i < hi; i++){
+    x = i;
+    for(k = 0; k < WORK; k++)
+      x = x * 1103515245 + 12345;
+    out[i] = x;
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct pool *pool;
+  uint64 t0, t1;
+  uint kcyc, base = 0, speedup;
+  int n, max = 4;
+
+  if(argc >= 2)
+    max = atoi(argv[1]);
+
+  for(n = 1; n <= max; n++){
+    if((pool = pool_create(n)) == 0){
+      printf(1, "pool_create(%d) failed\n", n);
+      exit();
+    }
+    t0 = rdtsc();
+    parallel_for(pool, 0, N, GRAIN, body, 0);
+    t1 = rdtsc();
+    pool_destroy(pool);
+
+    kcyc = (uint)((t1 - t0) >> 10);
+    if(n == 1)
+      base = kcyc;
+    speedup = base * 100 / (kcyc ? kcyc : 1);
+    printf(1, "%d workers: %d Kcycles, speedup %d.%d%d\n", n, kcyc,
+           speedup / 100, speedup / 10 % 10, speedup % 10);
+  }
+  exit();
+}
@@ -0,0 +1,97 @@
+// Check the ulock mutex and barrier with several threads:
+// no two threads inside the mutex at once and no lost
+// updates, and no thread past a barrier before all reach it.
+// usage: test_ulock [threads]
+
+#include "types.h"
+#include "stat.h"
+#include "user.h"
+
+#define NITER  20000  // Mutex rounds per thread
+#define ROUNDS 500    // Barrier rounds
+#define MAXT   8
+
+mutex_t m;
+barrier_t bar;
+int nthread;
+volatile int inside, counter, overlaps;
+volatile int round[MAXT];
+volatile int early;
+
+void*
+locker(void *arg)
+{
+  int i;
+
+  for(i = 0; i < NITER; i++){
+    mutex_lock(&m);
+    if(inside++ != 0)
+      overlaps++;
+    counter = counter + 1;
+    inside--;
+    mutex_unlock(&m);
+  }
+  thread_exit(0);
+  return 0;
+}
+
+void*
+waiter(void *arg)
+{
+  int id = (int)arg;
+  int r, j;
+
+  for(r = 1; r <= ROUNDS; r++){
+    round[id] = r;
+    barrier_wait(&bar);
+    for(j = 0; j < nthread; j++)
+      if(round[j] < r)
+        early++;
+    // Nobody starts round r+1 until everyone has checked round r
+    barrier_wait(&bar);
+  }
+  thread_exit(0);
+  return 0;
+}
+
+void
+run(void *(*fn)(void*))
+{
+  thread_t t[MAXT];
+  void *ret;
+  int i;
+
+  for(i = 0; i < nthread; i++)
+    if(thread_create(&t[i], fn, (void*)i) < 0){
+      printf(1, "thread_create failed\n");
+      exit();
+    }
+  for(i = 0; i < nthread; i++)
+    thread_join(t[i], &ret);
+}
+
+int
+main(int argc, char *argv[])
+{
+  nthread = 4;
+  if(argc >= 2)
+    nthread = atoi(argv[1]);
+  if(nthread < 2 || nthread > MAXT)
+    nthread = 4;
+
+  mutex_init(&m);
+  run(locker);
+  if(counter != nthread * NITER || overlaps != 0)
+    printf(1, "mutex: FAILED, counter %d of %d, %d overlaps\n",
+           counter, nthread * NITER, overlaps);
+  else
+    printf(1, "mutex: ok\n");
+
+  barrier_init(&bar, nthread);
+  run(waiter);
+  if(early != 0)
+    printf(1, "barrier: FAILED, %d early releases\n", early);
+  else
+    printf(1, "barrier: ok\n");
+  exit();
+}
@@ -0,0 +1,73 @@
+// Time base: calibrate the TSC against the 8253/8254 PIT
+// and convert TSC cycles to nanoseconds.
+// The PIT runs at a fixed 1193182 Hz, so it is the only
+// clock whose frequency xv6 knows without asking.
+
+#include "types.h"
+#include "defs.h"
+#include "param.h"
+#include "x86.h"
+
+#define PIT_HZ      1193182
+#define PIT_CH2     0x42        // Channel 2 data port
+#define PIT_MODE    0x43        // Mode/command register
+#define PIT_GATE    0x61        // Channel 2 gate and output
+  #define GATE2      0x01       // Gate input of channel 2
+  #define SPKR       0x02       // Speaker data enable
+  #define OUT2       0x20       // Output of channel 2
+
+#define CALMS       10          // Calibrate over this many ms
+
+uint tsckhz;    // TSC cycles per millisecond
+
+// Divide a 64-bit n by d with two 32-bit divisions,
+// since the kernel is not linked with libgcc.
+uint64
+div64(uint64 n, uint d)
+{
+  uint hi, lo, qhi, qlo, r;
+
+  hi = n >> 32;
+  lo = n;
+  qhi = hi / d;
+  r = hi % d;
+  asm("divl %4" : "=a" (qlo), "=d" (r) : "0" (lo), "1" (r), "rm" (d));
+  return ((uint64)qhi << 32) | qlo;
+}
+
+// Conversions for intervals (up to an hour or so of cycles).
+uint64
+tsc2ns(uint64 cycles)
+{
+  return div64(cycles * 1000000, tsckhz);
+}
+
+uint64
+ns2tsc(uint64 ns)
+{
+  return div64(ns * tsckhz, 1000000);
+}
+
+// Count TSC cycles while PIT channel 2 counts down CALMS ms.
+void
+timerinit(void)
+{
+  uint count = PIT_HZ / 1000 * CALMS;
+  uint64 t0, t1;
+
+  // Gate channel 2 on with the speaker off, mode 0 (interrupt
+  // on terminal count): OUT2 goes high when the count expires.
+  outb(PIT_GATE, (inb(PIT_GATE) & ~SPKR) | GATE2);
+  outb(PIT_MODE, 0xB0);  // channel 2, lobyte/hibyte, mode 0
+  outb(PIT_CH2, count & 0xFF);
+  outb(PIT_CH2, count >> 8);
+
+  t0 = rdtsc();
+  while((inb(PIT_GATE) & OUT2) == 0)
+    ;
+  t1 = rdtsc();
+
+  tsckhz = div64(t1 - t0, CALMS);
+  if(tsckhz == 0)
+    tsckhz = 1;
+}
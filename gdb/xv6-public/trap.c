@@ -14,7 +14,6 @@ extern uint vectors[];  // in vectors.S: array of 256 entry pointers
 struct spinlock tickslock;
 uint ticks;
 uint mlfq_ticks;
-volatile int local_ticks;
 
 void
 tvinit(void)
@@ -38,13 +37,21 @@ idtinit(void)
 void
 trap(struct trapframe *tf)
 {
+  int fromuser = (tf->cs&3) == DPL_USER;
+
+  // Time up to here was spent in user mode
+  if(fromuser)
+    chargetime(1);
+
   if(tf->trapno == T_SYSCALL){
     if(myproc()->killed)
       exit();
     myproc()->tf = tf;
     syscall();
+    execover();
     if(myproc()->killed)
       exit();
+    chargetime(0);
     return;
   }
 
@@ -54,35 +61,25 @@ trap(struct trapframe *tf)
       acquire(&tickslock);
       ticks++;
       mlfq_ticks++;
-      /*
-      if(local_ticks <= 0) {
-	if(num_stride > 0) {
-	  local_ticks = 5;
-	} else {
-	  switch(maxlev()) {
-	    case 2:
-	      local_ticks = 5;
-	      break;
-	    case 1:
-	      local_ticks = 10;
-	      break;
-	    case 0:
-	      local_ticks = 20;
-	      break;
-	    default:
-	      local_ticks = 5;
-	      break;
-	  }
-	}
-      }
-      */
-      local_ticks--; // THE LOCAL TICK
+      if(mlfq_ticks % 200 == 0) {
+        boost();
+      } //FOR MLFQ + STRIDE
       wakeup(&ticks);
       release(&tickslock);
+      wheeltick(ticks);
+      mycpu()->slice--; // THE LOCAL TICK
+    } else {
+      // Tickless cpu: its one-shot quantum has run out
+      mycpu()->slice = 0;
     }
-    if(mlfq_ticks % 200 == 0) {
-      boost();
-    } //FOR MLFQ + STRIDE
+    lapiceoi();
+    break;
+  case T_IRQ0 + IRQ_WAKEUP:
+    // Another cpu queued work for this idle one, or handed
+    // it a gang member to run now in place of the current
+    // proc; scheduler() takes it from here.
+    if(mycpu()->gangnext)
+      mycpu()->slice = 0;
     lapiceoi();
     break;
   case T_IRQ0 + IRQ_IDE:
@@ -107,6 +104,14 @@ trap(struct trapframe *tf)
     lapiceoi();
     break;
 
+  case T_PGFLT:
+    // A write to a copy-on-write page, from user space or
+    // from the kernel copying out to it, just needs a copy
+    if(myproc() && (tf->err & FEC_WR) &&
+       cowfault(myproc()->pgdir, rcr2()) == 0)
+      break;
+    // Otherwise a real fault: fall through
+
   //PAGEBREAK: 13
   default:
     if(myproc() == 0 || (tf->cs&3) == 0){
@@ -136,16 +141,24 @@ trap(struct trapframe *tf)
     //cprintf("change\n");
     if(myproc()->is_stride == 1) mlfq_ticks--;
     
-    //thread supported trapping
-    if(local_ticks <= 0) {
-      multithreading = 0;
+    if(mycpu()->slice <= 0)
       yield();
-    } else {
-      if(multithreading == 1) yield();
-    }
   }
 
+  // Or to a gang member another cpu handed this one
+  if(myproc() && myproc()->state == RUNNING &&
+     tf->trapno == T_IRQ0+IRQ_WAKEUP && mycpu()->slice <= 0)
+    yield();
+
+  // Take over an image one of its threads exec'd
+  if(myproc() && (tf->cs&3) == DPL_USER)
+    execover();
+
   // Check if the process has been killed since we yielded
   if(myproc() && myproc()->killed && (tf->cs&3) == DPL_USER)
     exit();
+
+  // Back to user mode: the time in here was kernel time
+  if(fromuser)
+    chargetime(0);
 }
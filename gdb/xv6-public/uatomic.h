@@ -0,0 +1,50 @@
+// Atomic operations for user programs.
+// cas() and fetch_add() are lock-prefixed, so they are also full
+// memory barriers. Plain loads and stores of shared words are not:
+// order them with mfence() or barrier() where it matters.
+
+// Atomically set *addr to new if it holds old.
+// Returns the value *addr held.
+static inline int
+cas(volatile int *addr, int old, int new)
+{
+  int prev;
+
+  asm volatile("lock; cmpxchgl %2, %1" :
+               "=a" (prev), "+m" (*addr) :
+               "r" (new), "0" (old) :
+               "memory", "cc");
+  return prev;
+}
+
+// Atomically add n to *addr. Returns the old value.
+static inline int
+fetch_add(volatile int *addr, int n)
+{
+  asm volatile("lock; xaddl %0, %1" :
+               "+r" (n), "+m" (*addr) :
+               :
+               "memory", "cc");
+  return n;
+}
+
+// Order all earlier loads and stores before later ones.
+static inline void
+mfence(void)
+{
+  asm volatile("mfence" : : : "memory");
+}
+
+// Keep the compiler from moving memory accesses across it.
+static inline void
+barrier(void)
+{
+  asm volatile("" : : : "memory");
+}
+
+// Spin-wait hint.
+static inline void
+cpu_relax(void)
+{
+  asm volatile("pause" : : : "memory");
+}
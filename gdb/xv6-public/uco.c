@@ -0,0 +1,256 @@
+// Coroutines: cooperative user-level threads.
+//
+// Any number of coroutines are multiplexed on the thread that
+// calls co_run(), each on a small stack of its own, switching
+// with uswtch() and never entering the kernel to do so.
+// A coroutine that has to make a blocking call hands it to
+// co_call(), which runs it on one of a few kernel threads
+// while the other coroutines keep going.
+
+#include "types.h"
+#include "user.h"
+#include "uatomic.h"
+
+#define COSTACK   4096  // Stack bytes per coroutine
+#define NCOWORKER 4     // Kernel threads for blocking calls
+
+// Saved registers, as pushed by uswtch()
+struct cocontext {
+  uint edi;
+  uint esi;
+  uint ebx;
+  uint ebp;
+  uint eip;
+};
+
+enum costate { CO_READY, CO_RUNNING, CO_BLOCKED, CO_DONE };
+
+struct co {
+  struct cocontext *ctx;   // uswtch() here to run it
+  enum costate state;
+  void (*fn)(void*);
+  void *arg;
+  char *stack;
+  struct co *next;         // Run queue, call queue or free list
+  int (*call)(void*);      // Blocking call for a worker to run
+  void *callarg;
+  int ret;
+};
+
+void uswtch(struct cocontext**, struct cocontext*);
+
+static struct cocontext *schedctx;  // co_run()'s context
+static struct co *cur;              // Running coroutine
+static struct co *readyq, *readytail;
+static struct co *freeco;           // Finished ones, stacks and all
+static int nblocked;                // Coroutines in co_call()
+
+// Shared with the workers
+static mutex_t qlock;
+static cond_t qcond;
+static struct co *callq, *calltail; // Calls waiting for a worker
+static struct co *volatile doneq;   // Calls done, newest first
+static volatile int doneseq;        // Bumped by each finished call
+static int stopping;
+static thread_t workers[NCOWORKER];
+static int nworkers;
+
+static void
+pushready(struct co *c)
+{
+  c->state = CO_READY;
+  c->next = 0;
+  if(readytail)
+    readytail->next = c;
+  else
+    readyq = c;
+  readytail = c;
+}
+
+static struct co*
+popready(void)
+{
+  struct co *c = readyq;
+
+  if(c && (readyq = c->next) == 0)
+    readytail = 0;
+  return c;
+}
+
+// First code a coroutine runs, from its fresh stack.
+static void
+costart(void)
+{
+  cur->fn(cur->arg);
+  co_exit();
+}
+
+// Create a coroutine running fn(arg); co_run() will start it.
+// Returns -1 if out of memory.
+int
+co_create(void (*fn)(void*), void *arg)
+{
+  struct co *c;
+
+  if((c = freeco) != 0)
+    freeco = c->next;
+  else {
+    if((c = malloc(sizeof(*c))) == 0)
+      return -1;
+    if((c->stack = malloc(COSTACK)) == 0){
+      free(c);
+      return -1;
+    }
+  }
+  c->fn = fn;
+  c->arg = arg;
+  // uswtch() will "return" to costart()
+  c->ctx = (struct cocontext*)(c->stack + COSTACK - sizeof(uint)) - 1;
+  memset(c->ctx, 0, sizeof(*c->ctx));
+  c->ctx->eip = (uint)costart;
+  pushready(c);
+  return 0;
+}
+
+// Let the other ready coroutines run.
+void
+co_yield(void)
+{
+  struct co *c = cur;
+
+  if(c == 0)
+    return;
+  pushready(c);
+  uswtch(&c->ctx, schedctx);
+}
+
+void
+co_exit(void)
+{
+  cur->state = CO_DONE;
+  uswtch(&cur->ctx, schedctx);
+  printf(2, "co_exit: resumed\n");
+  exit();
+}
+
+static void*
+coworker(void *arg)
+{
+  struct co *c;
+
+  mutex_lock(&qlock);
+  for(;;){
+    while(callq == 0 && !stopping)
+      cond_wait(&qcond, &qlock);
+    if((c = callq) == 0)
+      break;
+    if((callq = c->next) == 0)
+      calltail = 0;
+    mutex_unlock(&qlock);
+
+    c->ret = c->call(c->callarg);
+
+    mutex_lock(&qlock);
+    c->next = doneq;
+    doneq = c;
+    fetch_add(&doneseq, 1);
+    futex_wake(&doneseq, 1);
+  }
+  mutex_unlock(&qlock);
+  thread_exit(0);
+  return 0;
+}
+
+// Run fn(arg), which may block in the kernel, on a worker
+// thread, and return what it returns. The coroutine sleeps
+// meanwhile and the others run. Outside a coroutine, just
+// calls fn. fn must not use the coroutine calls.
+int
+co_call(int (*fn)(void*), void *arg)
+{
+  struct co *c = cur;
+
+  if(c == 0)
+    return fn(arg);
+  if(nworkers < NCOWORKER && nblocked >= nworkers)
+    if(thread_create(&workers[nworkers], coworker, 0) == 0)
+      nworkers++;
+  if(nworkers == 0)
+    return fn(arg);
+
+  c->call = fn;
+  c->callarg = arg;
+  c->state = CO_BLOCKED;
+  c->next = 0;
+  nblocked++;
+  mutex_lock(&qlock);
+  if(calltail)
+    calltail->next = c;
+  else
+    callq = c;
+  calltail = c;
+  cond_signal(&qcond);
+  mutex_unlock(&qlock);
+  uswtch(&c->ctx, schedctx);
+  return c->ret;
+}
+
+// Move finished calls to the run queue, oldest first.
+static void
+collect(void)
+{
+  struct co *c, *done = 0;
+
+  mutex_lock(&qlock);
+  while((c = doneq) != 0){
+    doneq = c->next;
+    c->next = done;
+    done = c;
+  }
+  mutex_unlock(&qlock);
+  for(; (c = done) != 0; nblocked--){
+    done = c->next;
+    pushready(c);
+  }
+}
+
+// Run coroutines until all of them have finished.
+void
+co_run(void)
+{
+  struct co *c;
+  void *retval;
+  int seq, i;
+
+  for(;;){
+    if(doneq)
+      collect();
+    if((c = popready()) == 0){
+      if(nblocked == 0)
+        break;
+      // Nothing to run until a worker finishes a call
+      seq = doneseq;
+      barrier();
+      if(doneq == 0)
+        futex_wait(&doneseq, seq);
+      continue;
+    }
+    c->state = CO_RUNNING;
+    cur = c;
+    uswtch(&schedctx, c->ctx);
+    cur = 0;
+    if(c->state == CO_DONE){
+      c->next = freeco;
+      freeco = c;
+    }
+  }
+
+  mutex_lock(&qlock);
+  stopping = 1;
+  cond_broadcast(&qcond);
+  mutex_unlock(&qlock);
+  for(i = 0; i < nworkers; i++)
+    thread_join(workers[i], &retval);
+  nworkers = 0;
+  stopping = 0;
+}
@@ -0,0 +1,112 @@
+// User-level mutexes, condition variables and barriers
+// for threads, built on futex_wait() and futex_wake().
+// Uncontended operations stay in user space.
+
+#include "types.h"
+#include "user.h"
+#include "param.h"
+#include "x86.h"
+#include "uatomic.h"
+
+void
+mutex_init(mutex_t *m)
+{
+  m->state = 0;
+}
+
+// The state goes to 2 whenever someone may be asleep on
+// the mutex, so unlock makes a syscall only then.
+void
+mutex_lock(mutex_t *m)
+{
+  int c;
+
+  if((c = cas(&m->state, 0, 1)) == 0)
+    return;
+  if(c != 2)
+    c = xchg((volatile uint*)&m->state, 2);
+  while(c != 0){
+    futex_wait(&m->state, 2);
+    c = xchg((volatile uint*)&m->state, 2);
+  }
+}
+
+void
+mutex_unlock(mutex_t *m)
+{
+  if(xchg((volatile uint*)&m->state, 0) == 2)
+    futex_wake(&m->state, 1);
+}
+
+void
+cond_init(cond_t *cv)
+{
+  cv->seq = 0;
+  cv->waiters = 0;
+}
+
+// A signal between the unlock and the futex_wait()
+// changes seq, so the wait returns at once.
+// A waiter counts itself in before reading seq, and a signal
+// bumps seq before reading the count, both lock-prefixed: so
+// either the signal sees the waiter, or the waiter sees the
+// new seq. Signals with no one waiting make no syscall.
+void
+cond_wait(cond_t *cv, mutex_t *m)
+{
+  int seq;
+
+  fetch_add(&cv->waiters, 1);
+  seq = cv->seq;
+  mutex_unlock(m);
+  futex_wait(&cv->seq, seq);
+  fetch_add(&cv->waiters, -1);
+  // Relock as contended: other waiters may be behind us
+  while(xchg((volatile uint*)&m->state, 2) != 0)
+    futex_wait(&m->state, 2);
+}
+
+void
+cond_signal(cond_t *cv)
+{
+  fetch_add(&cv->seq, 1);
+  if(cv->waiters > 0)
+    futex_wake(&cv->seq, 1);
+}
+
+void
+cond_broadcast(cond_t *cv)
+{
+  fetch_add(&cv->seq, 1);
+  if(cv->waiters > 0)
+    futex_wake(&cv->seq, NPROC);
+}
+
+void
+barrier_init(barrier_t *b, int n)
+{
+  mutex_init(&b->lock);
+  cond_init(&b->cv);
+  b->n = n;
+  b->count = 0;
+  b->phase = 0;
+}
+
+// Wait until n threads have called barrier_wait().
+void
+barrier_wait(barrier_t *b)
+{
+  int phase;
+
+  mutex_lock(&b->lock);
+  phase = b->phase;
+  if(++b->count == b->n){
+    b->count = 0;
+    b->phase++;
+    cond_broadcast(&b->cv);
+  } else {
+    while(phase == b->phase)
+      cond_wait(&b->cv, &b->lock);
+  }
+  mutex_unlock(&b->lock);
+}
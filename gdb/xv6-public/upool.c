@@ -0,0 +1,274 @@
+// Work-stealing thread pool and parallel_for.
+//
+// Each worker owns a Chase-Lev deque of tasks: the owner pushes
+// and takes at the bottom, idle workers steal from the top, and
+// only the last task left is fought over with cmpxchg. The thread
+// that creates a pool is its worker 0 and the one that calls
+// parallel_for(); the other workers are threads it creates.
+
+#include "types.h"
+#include "user.h"
+#include "uatomic.h"
+
+#define DQSIZE  256   // Tasks per deque, a power of 2
+#define NSPIN   1000  // Failed steal rounds before sleeping
+
+struct task {
+  void (*body)(void*, int, int);
+  void *arg;
+  int lo, hi;           // Iterations [lo, hi)
+  int grain;            // Split until at most this many are left
+  volatile int *left;   // Iterations of the parallel_for not yet run
+};
+
+struct deque {
+  volatile int top;     // Next to steal
+  volatile int bottom;  // Next to push; written by the owner only
+  struct task slot[DQSIZE];
+};
+
+struct worker {
+  struct pool *pool;
+  uint seed;            // For picking steal victims
+  thread_t tid;
+  struct deque dq;
+};
+
+struct pool {
+  int n;
+  volatile int stop;
+  volatile int seq;     // Bumped when there is work for idle workers
+  volatile int nidle;   // Workers asleep on seq, or about to be
+  struct worker *w;
+};
+
+// Push t at the bottom of d. Owner only.
+// Returns -1 if d is full.
+static int
+dqpush(struct deque *d, struct task *t)
+{
+  int b = d->bottom;
+
+  if(b - d->top >= DQSIZE)
+    return -1;
+  d->slot[b & (DQSIZE-1)] = *t;
+  barrier();  // x86 keeps stores in order; the compiler must too
+  d->bottom = b + 1;
+  return 0;
+}
+
+// Take the task at the bottom of d into t. Owner only.
+// Returns -1 if d is empty or a thief got the last task.
+static int
+dqtake(struct deque *d, struct task *t)
+{
+  int b, top, r;
+
+  b = d->bottom - 1;
+  d->bottom = b;
+  mfence();  // Publish bottom before reading top
+  top = d->top;
+  if(top > b){
+    d->bottom = b + 1;
+    return -1;
+  }
+  *t = d->slot[b & (DQSIZE-1)];
+  if(top < b)
+    return 0;
+  // The last task: race thieves for it
+  r = cas(&d->top, top, top + 1) == top ? 0 : -1;
+  d->bottom = b + 1;
+  return r;
+}
+
+// Steal the task at the top of d into t.
+// Returns -1 if d is empty or someone else got the task.
+// The copy may be torn if the owner reused the slot,
+// but then top has moved and the cmpxchg fails.
+static int
+dqsteal(struct deque *d, struct task *t)
+{
+  int top, b;
+
+  top = d->top;
+  barrier();
+  b = d->bottom;
+  if(top >= b)
+    return -1;
+  *t = d->slot[top & (DQSIZE-1)];
+  if(cas(&d->top, top, top + 1) != top)
+    return -1;
+  return 0;
+}
+
+static int
+anywork(struct pool *p)
+{
+  int i;
+
+  for(i = 0; i < p->n; i++)
+    if(p->w[i].dq.bottom > p->w[i].dq.top)
+      return 1;
+  return 0;
+}
+
+// Wake an idle worker for newly pushed work.
+static void
+wakeone(struct pool *p)
+{
+  mfence();  // Publish the push before reading nidle
+  if(p->nidle > 0){
+    fetch_add(&p->seq, 1);
+    futex_wake(&p->seq, 1);
+  }
+}
+
+// Sleep until wakeone() or pool_destroy().
+static void
+idle(struct worker *w)
+{
+  struct pool *p = w->pool;
+  int seq = p->seq;
+
+  fetch_add(&p->nidle, 1);
+  // Work pushed before nidle went up sent no wakeup
+  if(!anywork(p) && !p->stop)
+    futex_wait(&p->seq, seq);
+  fetch_add(&p->nidle, -1);
+}
+
+// Run t, first splitting off halves of its range onto our
+// deque for others to steal until it is down to the grain.
+static void
+runtask(struct worker *w, struct task *t)
+{
+  struct task right;
+  int mid;
+
+  while(t->hi - t->lo > t->grain){
+    mid = t->lo + (t->hi - t->lo) / 2;
+    right = *t;
+    right.lo = mid;
+    if(dqpush(&w->dq, &right) < 0)
+      break;  // Deque full: run the rest here
+    wakeone(w->pool);
+    t->hi = mid;
+  }
+  t->body(t->arg, t->lo, t->hi);
+  fetch_add(t->left, -(t->hi - t->lo));
+}
+
+// Run one task, our own or a stolen one.
+// Returns 0 if there was none to run.
+static int
+runone(struct worker *w)
+{
+  struct pool *p = w->pool;
+  struct task t;
+  int i, v;
+
+  if(dqtake(&w->dq, &t) == 0){
+    runtask(w, &t);
+    return 1;
+  }
+  w->seed = w->seed * 1103515245 + 12345;
+  v = (w->seed >> 16) % p->n;
+  for(i = 0; i < p->n; i++, v = (v + 1) % p->n){
+    if(&p->w[v] != w && dqsteal(&p->w[v].dq, &t) == 0){
+      runtask(w, &t);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void*
+workermain(void *arg)
+{
+  struct worker *w = arg;
+  int spins = 0;
+
+  while(!w->pool->stop){
+    if(runone(w))
+      spins = 0;
+    else if(++spins < NSPIN)
+      cpu_relax();
+    else {
+      idle(w);
+      spins = 0;
+    }
+  }
+  thread_exit(0);
+  return 0;
+}
+
+// Create a pool of n workers: the caller and n-1 threads.
+struct pool*
+pool_create(int n)
+{
+  struct pool *p;
+  int i;
+
+  if(n < 1 || (p = malloc(sizeof(*p))) == 0)
+    return 0;
+  if((p->w = malloc(n * sizeof(p->w[0]))) == 0){
+    free(p);
+    return 0;
+  }
+  memset(p->w, 0, n * sizeof(p->w[0]));
+  p->n = n;
+  p->stop = 0;
+  p->seq = 0;
+  p->nidle = 0;
+  for(i = 0; i < n; i++){
+    p->w[i].pool = p;
+    p->w[i].seed = i + 1;
+  }
+  for(i = 1; i < n; i++){
+    if(thread_create(&p->w[i].tid, workermain, &p->w[i]) != 0){
+      p->n = i;
+      pool_destroy(p);
+      return 0;
+    }
+  }
+  return p;
+}
+
+void
+pool_destroy(struct pool *p)
+{
+  void *retval;
+  int i;
+
+  p->stop = 1;
+  fetch_add(&p->seq, 1);
+  futex_wake(&p->seq, p->n);
+  for(i = 1; i < p->n; i++)
+    thread_join(p->w[i].tid, &retval);
+  free(p->w);
+  free(p);
+}
+
+// Run body(arg, l, h) over subranges [l, h) covering [lo, hi),
+// each at most grain long, on the pool's workers. Returns when
+// all have run. Only the thread that created p may call it.
+void
+parallel_for(struct pool *p, int lo, int hi, int grain,
+             void (*body)(void*, int, int), void *arg)
+{
+  volatile int left = hi - lo;
+  struct task t;
+
+  if(lo >= hi)
+    return;
+  t.body = body;
+  t.arg = arg;
+  t.lo = lo;
+  t.hi = hi;
+  t.grain = grain < 1 ? 1 : grain;
+  t.left = &left;
+  runtask(&p->w[0], &t);
+  while(left > 0)
+    if(!runone(&p->w[0]))
+      cpu_relax();
+}
@@ -1,5 +1,22 @@
 struct stat;
 struct rtcdate;
+struct pool;
+
+// ulock.c: futex-based locks, zero-initialized
+typedef struct {
+  volatile int state;   // 0 free, 1 locked, 2 locked with waiters
+} mutex_t;
+typedef struct {
+  volatile int seq;     // Bumped by every signal
+  volatile int waiters; // Threads in cond_wait()
+} cond_t;
+typedef struct {
+  mutex_t lock;
+  cond_t cv;
+  int n;                // Threads to wait for
+  int count;            // Threads arrived in this phase
+  int phase;
+} barrier_t;
 
 // system calls
 int fork(void);
@@ -22,6 +39,7 @@ int dup(int);
 int getpid(void);
 char* sbrk(int);
 int sleep(int);
+int nanosleep(uint);
 int uptime(void);
 int myfunction(char*);
 int getppid(void);
@@ -29,6 +47,8 @@ int yield(void);
 int procdump(void);
 int getlev(void);
 int set_cpu_share(int);
+int set_thread_weight(int, int);
+int set_gang(int);
 int pread(int, void*, int, int);
 int pwrite(int, void*, int, int);
 int sync(void);
@@ -41,6 +61,10 @@ int thread_create(thread_t*, void*(start_routine)(void*), void*);
 void thread_exit(void*) __attribute__((noreturn));
 int thread_join(thread_t, void**);
 
+// futexes
+int futex_wait(volatile int*, int);
+int futex_wake(volatile int*, int);
+
 // ulib.c
 int stat(const char*, struct stat*);
 char* strcpy(char*, const char*);
@@ -54,3 +78,26 @@ void* memset(void*, int, uint);
 void* malloc(uint);
 void free(void*);
 int atoi(const char*);
+
+// ulock.c
+void mutex_init(mutex_t*);
+void mutex_lock(mutex_t*);
+void mutex_unlock(mutex_t*);
+void cond_init(cond_t*);
+void cond_wait(cond_t*, mutex_t*);
+void cond_signal(cond_t*);
+void cond_broadcast(cond_t*);
+void barrier_init(barrier_t*, int);
+void barrier_wait(barrier_t*);
+
+// upool.c
+struct pool* pool_create(int);
+void pool_destroy(struct pool*);
+void parallel_for(struct pool*, int, int, int, void(*)(void*, int, int), void*);
+
+// uco.c
+int co_create(void(*)(void*), void*);
+void co_yield(void);
+void co_exit(void) __attribute__((noreturn));
+int co_call(int(*)(void*), void*);
+void co_run(void);
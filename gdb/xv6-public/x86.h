@@ -117,6 +117,15 @@ sti(void)
   asm volatile("sti");
 }
 
+// Enable interrupts and halt until the next one. sti only
+// takes effect after the following instruction, so an interrupt
+// pending before this cannot slip in ahead of the hlt.
+static inline void
+stihlt(void)
+{
+  asm volatile("sti; hlt" : : : "memory");
+}
+
 static inline uint
 xchg(volatile uint *addr, uint newval)
 {
@@ -144,12 +153,10 @@ lcr3(uint val)
   asm volatile("movl %0,%%cr3" : : "r" (val));
 }
 
-static inline int
-stamp(void)
+static inline void
+invlpg(void *addr)
 {
-  int game;
-  asm volatile("lock; rdtsc; mov %%eax, %0" : "=r" (game));
-  return game;
+  asm volatile("invlpg (%0)" : : "r" (addr) : "memory");
 }
 
 // I need esp
@@ -167,10 +174,34 @@ setesp(uint esp)
   asm volatile("movl %0,%%esp" : : "r" (esp));
 }
 
+static inline uint64
+rdtsc(void)
+{
+  uint64 tsc;
+  asm volatile("rdtsc" : "=A" (tsc));
+  return tsc;
+}
+
+static inline void
+wrmsr(uint msr, uint64 val)
+{
+  asm volatile("wrmsr" : : "c" (msr), "A" (val));
+}
+
+static inline void
+cpuidinfo(uint leaf, uint *eax, uint *ebx, uint *ecx, uint *edx)
+{
+  asm volatile("cpuid" :
+               "=a" (*eax), "=b" (*ebx), "=c" (*ecx), "=d" (*edx) :
+               "a" (leaf), "c" (0));
+}
+
+// Arm the local APIC timer (in TSC-deadline mode) to fire
+// when the TSC reaches deadline. 0 disarms it.
 static inline void
-tsc_deadline(int remain)
+tsc_deadline(uint64 deadline)
 {
-  asm volatile("mov $0x630, %%ecx; mov $0x0, %%edx; mov %0, %%eax; wrmsr" : : "r" (remain));
+  wrmsr(0x6E0, deadline);  // IA32_TSC_DEADLINE
 }
 
 /*